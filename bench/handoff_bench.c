@@ -0,0 +1,151 @@
+// Thread handoff latency: condvar wakeups vs. bounded spinning, floating vs. pinned threads.
+//
+// usage: handoff_bench [messages] [gap us] [spin us] [producer core] [consumer core]
+//
+// A producer pushes a message into a Lanes (the structure behind sendList/receiveList) every
+// gap microseconds and a consumer takes it off the same way sendMsgThread/screenOutputThread
+// do. The time from push to pickup is recorded into a histogram for each mode:
+//   block        - consumer sleeps on the condvar, threads float
+//   spin         - consumer spins for spin us before sleeping, threads float
+//   block+pinned - as block, producer and consumer pinned to the given cores
+//   spin+pinned  - as spin, pinned
+// Pinned modes are skipped when fewer than two cores are available. A message the lanes have no
+// room for (consumer more than LANES_MAX_DATA behind) is counted as dropped and fails the run,
+// since the histogram no longer covers every message.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../lanes.h"
+#include "../stats.h"
+
+typedef struct Run_s Run;
+struct Run_s {
+    Lanes lanes;
+    pthread_mutex_t mutex;
+    pthread_cond_t flag;
+    int messages;
+    uint64_t gapNs;
+    uint64_t spinNs;
+    bool done;
+    int dropped;
+    Hist hist;
+};
+
+static void pin(int core) {
+    if (core < 0) {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+static int producerCore = -1;
+static int consumerCore = -1;
+
+static void* producer(void* arg) {
+    Run* run = arg;
+    pin(producerCore);
+    uint64_t next = Proto_now_ns();
+    for (int i = 0; i < run -> messages; i++) {
+        //pace the messages so every pickup measures a wakeup, not a backlog
+        next += run -> gapNs;
+        while (Proto_now_ns() < next) {
+            usleep(0);
+        }
+        Message* message = Message_create(PROTO_TEXT, "hello\n", 6);
+        pthread_mutex_lock(&run -> mutex);
+        if (Lanes_push(&run -> lanes, message) != LIST_SUCCESS) {
+            free(message); //consumer fell more than LANES_MAX_DATA behind
+            run -> dropped++;
+        }
+        pthread_cond_signal(&run -> flag);
+        pthread_mutex_unlock(&run -> mutex);
+    }
+    pthread_mutex_lock(&run -> mutex);
+    run -> done = true;
+    pthread_cond_signal(&run -> flag);
+    pthread_mutex_unlock(&run -> mutex);
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    Run* run = arg;
+    pin(consumerCore);
+    while (1) {
+        Lanes_spin(&run -> lanes, run -> spinNs, &run -> done);
+        pthread_mutex_lock(&run -> mutex);
+        while (Lanes_count(&run -> lanes) == 0 && !run -> done) {
+            pthread_cond_wait(&run -> flag, &run -> mutex);
+        }
+        if (Lanes_count(&run -> lanes) == 0 && run -> done) {
+            pthread_mutex_unlock(&run -> mutex);
+            break;
+        }
+        uint64_t pickedUp = Proto_now_ns();
+        Message* message = Lanes_pop(&run -> lanes);
+        pthread_mutex_unlock(&run -> mutex);
+        Hist_record(&run -> hist, pickedUp - message -> queuedNs);
+        free(message);
+    }
+    return NULL;
+}
+
+//Returns the number of messages dropped
+static int runMode(const char* name, int messages, uint64_t gapNs, uint64_t spinNs, bool pinned,
+                   int pCore, int cCore) {
+    Run* run = calloc(1, sizeof(Run));
+    Lanes_init(&run -> lanes);
+    pthread_mutex_init(&run -> mutex, NULL);
+    pthread_cond_init(&run -> flag, NULL);
+    run -> messages = messages;
+    run -> gapNs = gapNs;
+    run -> spinNs = spinNs;
+    producerCore = pinned ? pCore : -1;
+    consumerCore = pinned ? cCore : -1;
+
+    pthread_t p, c;
+    pthread_create(&c, NULL, consumer, run);
+    pthread_create(&p, NULL, producer, run);
+    pthread_join(p, NULL);
+    pthread_join(c, NULL);
+
+    Hist_print(stdout, name, &run -> hist);
+    int dropped = run -> dropped;
+    if (dropped > 0) {
+        printf("%s: %d of %d messages dropped, consumer fell more than %d behind\n",
+               name, dropped, messages, LANES_MAX_DATA);
+    }
+    Lanes_free(&run -> lanes, free);
+    free(run);
+    return dropped;
+}
+
+int main(int argc, char *argv[]) {
+    int messages = argc > 1 ? atoi(argv[1]) : 20000;
+    uint64_t gapNs = (argc > 2 ? strtoull(argv[2], NULL, 10) : 50) * 1000ull;
+    uint64_t spinNs = (argc > 3 ? strtoull(argv[3], NULL, 10) : 100) * 1000ull;
+    int pCore = argc > 4 ? atoi(argv[4]) : 0;
+    int cCore = argc > 5 ? atoi(argv[5]) : 1;
+
+    int dropped = 0;
+    dropped += runMode("block", messages, gapNs, 0, false, pCore, cCore);
+    dropped += runMode("spin", messages, gapNs, spinNs, false, pCore, cCore);
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        printf("pinned modes skipped: fewer than two cores online\n");
+    } else {
+        dropped += runMode("block+pinned", messages, gapNs, 0, true, pCore, cCore);
+        dropped += runMode("spin+pinned", messages, gapNs, spinNs, true, pCore, cCore);
+    }
+    if (dropped > 0) {
+        fprintf(stderr, "handoff_bench: %d messages dropped, results incomplete\n", dropped);
+        return 1;
+    }
+    return 0;
+}
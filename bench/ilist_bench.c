@@ -0,0 +1,108 @@
+// Queueing cost: List_append/List_remove with strdup'd payloads vs. the intrusive MessageList.
+//
+// usage: ilist_bench [rounds] [depth]
+//
+// Every round fills a queue with depth messages and drains it again, oldest first, which is
+// what sendList/receiveList see. depth stays below LIST_MAX_NUM_NODES so List never runs out
+// of nodes. Four variants:
+//   List + strdup      - the original path: strdup the line, List_append a node pointing at it
+//   MessageList        - Message_create (payload inline) and an intrusive push/pop
+//   MessageList reuse  - push/pop only, on preallocated messages (the queueing cost by itself)
+//   List reuse         - List_append/List_remove only, on the same preallocated messages
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../list.h"
+#include "../proto.h"
+
+static const char line[] = "a typical chat line, a few dozen bytes long\n";
+
+static void report(const char* name, uint64_t startNs, long ops, long checksum) {
+    double ns = (double)(Proto_now_ns() - startNs);
+    printf("%-20s %8.1f ns per push+pop  (checksum %ld)\n", name, ns / (double)ops, checksum);
+}
+
+int main(int argc, char *argv[]) {
+    long rounds = argc > 1 ? atol(argv[1]) : 200000;
+    int depth = argc > 2 ? atoi(argv[2]) : 64;
+    if (depth < 1 || depth > LIST_MAX_NUM_NODES) {
+        fprintf(stderr, "depth must be 1..%d\n", LIST_MAX_NUM_NODES);
+        return 1;
+    }
+    long ops = rounds * depth;
+    long checksum = 0;
+
+    //List + strdup: two allocations and a pool node per message
+    List* list = List_create();
+    uint64_t start = Proto_now_ns();
+    for (long r = 0; r < rounds; r++) {
+        for (int i = 0; i < depth; i++) {
+            List_append(list, strdup(line));
+        }
+        for (int i = 0; i < depth; i++) {
+            List_first(list);
+            char* item = List_remove(list);
+            checksum += item[0];
+            free(item);
+        }
+    }
+    report("List + strdup", start, ops, checksum);
+    List_free(list, free);
+
+    //MessageList: one allocation per message, no node
+    IList queue;
+    IList_init(&queue);
+    checksum = 0;
+    start = Proto_now_ns();
+    for (long r = 0; r < rounds; r++) {
+        for (int i = 0; i < depth; i++) {
+            MessageList_push(&queue, Message_create(PROTO_TEXT, line, sizeof(line) - 1));
+        }
+        for (int i = 0; i < depth; i++) {
+            Message* message = MessageList_pop(&queue);
+            checksum += message -> data[0];
+            free(message);
+        }
+    }
+    report("MessageList", start, ops, checksum);
+
+    //MessageList reuse: the list operations alone, nothing allocated inside the loop
+    Message** pool = malloc(sizeof(Message*) * depth);
+    for (int i = 0; i < depth; i++) {
+        pool[i] = Message_create(PROTO_TEXT, line, sizeof(line) - 1);
+    }
+    checksum = 0;
+    start = Proto_now_ns();
+    for (long r = 0; r < rounds; r++) {
+        for (int i = 0; i < depth; i++) {
+            MessageList_push(&queue, pool[i]);
+        }
+        for (int i = 0; i < depth; i++) {
+            checksum += MessageList_pop(&queue) -> data[0];
+        }
+    }
+    report("MessageList reuse", start, ops, checksum);
+
+    //List reuse: same, through the node pool
+    list = List_create();
+    checksum = 0;
+    start = Proto_now_ns();
+    for (long r = 0; r < rounds; r++) {
+        for (int i = 0; i < depth; i++) {
+            List_append(list, pool[i]);
+        }
+        for (int i = 0; i < depth; i++) {
+            List_first(list);
+            checksum += ((Message *)List_remove(list)) -> data[0];
+        }
+    }
+    report("List reuse", start, ops, checksum);
+    List_free(list, NULL);
+
+    for (int i = 0; i < depth; i++) {
+        free(pool[i]);
+    }
+    free(pool);
+    return 0;
+}
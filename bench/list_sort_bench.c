@@ -0,0 +1,144 @@
+// Ordering a List: List_sort and List_merge vs. copying the items out, sorting and rebuilding.
+//
+// usage: list_sort_bench [largest size] (default 10000000, sizes go up by 10x from 100000)
+//
+// Items are (key, seq) pairs compared by key only; seq records the original order so the output
+// can be checked for stability. Three inputs per size:
+//   random    - keys drawn at random with plenty of duplicates
+//   nearly    - in order except for 1% of neighbours swapped (reordered datagrams)
+//   reversed  - keys in descending order
+// and three ways of ordering them:
+//   List_sort       - in place, relinking the nodes
+//   copy+qsort      - the old workaround: items out into an array, qsort (with seq as a
+//                     tie-breaker, qsort isn't stable), free the list and append them all again
+//   List_merge      - two sorted halves merged into one list (not a full sort, for scale)
+// Must be built with LIST_MAX_NUM_NODES at least the largest size, see the Makefile.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../list.h"
+#include "../proto.h"
+
+typedef struct Item_s Item;
+struct Item_s {
+    uint32_t key;
+    uint32_t seq;
+};
+
+static bool keyInOrder(void* pItem1, void* pItem2) {
+    return ((Item *)pItem1) -> key <= ((Item *)pItem2) -> key;
+}
+
+static int compareKeySeq(const void* a, const void* b) {
+    const Item* x = *(Item * const *)a;
+    const Item* y = *(Item * const *)b;
+    if (x -> key != y -> key) {
+        return x -> key < y -> key ? -1 : 1;
+    }
+    return x -> seq < y -> seq ? -1 : x -> seq > y -> seq;
+}
+
+static uint64_t rngState = 88172645463325252ull;
+static uint32_t nextRandom(void) {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (uint32_t)rngState;
+}
+
+//Fills items[0..n) with the given input pattern
+static void fill(Item* items, long n, int pattern) {
+    for (long i = 0; i < n; i++) {
+        items[i].seq = (uint32_t)i;
+        items[i].key = pattern == 0 ? nextRandom() % (uint32_t)(n / 4 + 1)
+                     : pattern == 1 ? (uint32_t)i : (uint32_t)(n - i);
+    }
+    if (pattern == 1) {
+        for (long i = 0; i < n / 100; i++) {
+            long j = nextRandom() % (uint32_t)(n - 1);
+            uint32_t key = items[j].key;
+            items[j].key = items[j + 1].key;
+            items[j + 1].key = key;
+        }
+    }
+}
+
+static List* build(Item* items, long from, long to) {
+    List* list = List_create();
+    for (long i = from; i < to; i++) {
+        List_append(list, &items[i]);
+    }
+    return list;
+}
+
+//Checks that list is ordered by key and stable (equal keys in seq order)
+static bool check(List* list, long n) {
+    if (List_count(list) != n) {
+        return false;
+    }
+    Item* prev = List_first(list);
+    for (Item* item = List_next(list); item != NULL; item = List_next(list)) {
+        if (item -> key < prev -> key || (item -> key == prev -> key && item -> seq < prev -> seq)) {
+            return false;
+        }
+        prev = item;
+    }
+    return true;
+}
+
+static void report(const char* pattern, const char* method, long n, uint64_t startNs, bool ok) {
+    double ns = (double)(Proto_now_ns() - startNs);
+    printf("%-9s %-11s n=%-9ld %8.1f ms  %6.1f ns/item  %s\n", pattern, method, n, ns / 1e6, ns / n,
+           ok ? "ok" : "NOT SORTED/STABLE");
+}
+
+int main(int argc, char *argv[]) {
+    long largest = argc > 1 ? atol(argv[1]) : 10000000;
+    if (largest > LIST_MAX_NUM_NODES) {
+        fprintf(stderr, "largest size must be at most LIST_MAX_NUM_NODES (%ld)\n", (long)LIST_MAX_NUM_NODES);
+        return 1;
+    }
+    const char* patterns[] = { "random", "nearly", "reversed" };
+    Item* items = malloc(sizeof(Item) * largest);
+    Item** array = malloc(sizeof(Item*) * largest);
+
+    for (long n = 100000; n <= largest; n *= 10) {
+        for (int pattern = 0; pattern < 3; pattern++) {
+            fill(items, n, pattern);
+            List* list = build(items, 0, n);
+            uint64_t start = Proto_now_ns();
+            List_sort(list, keyInOrder);
+            report(patterns[pattern], "List_sort", n, start, check(list, n));
+            List_free(list, NULL);
+
+            list = build(items, 0, n);
+            start = Proto_now_ns();
+            long count = 0;
+            for (Item* item = List_first(list); item != NULL; item = List_next(list)) {
+                array[count++] = item;
+            }
+            qsort(array, count, sizeof(Item*), compareKeySeq);
+            List_free(list, NULL);
+            list = List_create();
+            for (long i = 0; i < count; i++) {
+                List_append(list, array[i]);
+            }
+            report(patterns[pattern], "copy+qsort", n, start, check(list, n));
+            List_free(list, NULL);
+
+            //two sorted halves: the second half's seqs are all later, so ties must favour the first
+            List* first = build(items, 0, n / 2);
+            List* second = build(items, n / 2, n);
+            List_sort(first, keyInOrder);
+            List_sort(second, keyInOrder);
+            start = Proto_now_ns();
+            List_merge(first, second, keyInOrder);
+            report(patterns[pattern], "List_merge", n, start, check(first, n));
+            List_free(first, NULL);
+        }
+    }
+    free(items);
+    free(array);
+    return 0;
+}
@@ -0,0 +1,234 @@
+// Two s-talk endpoints on one host: UDP loopback vs. the shared memory ring (shm.h).
+//
+// usage: shm_bench [round trips] [datagrams] [datagram size]
+//
+// Two threads stand in for the two ends, each with a receive side and a send side like s-talk:
+// over UDP every datagram is a sendto and a recvfrom, over shared memory each end listens with
+// Shm_listen and the other connects to it, then datagrams go through the rings and a blocked
+// reader is woken through the eventfd. Two measurements per transport:
+//   latency     - a 64 byte datagram bounced back and forth, round trip times (reader blocks
+//                 between every datagram, so this includes the wakeup)
+//   throughput  - one end sends datagrams (default 1400 bytes, a well packed s-talk datagram)
+//                 as fast as it can, the other counts them. UDP drops what the socket buffer
+//                 can't hold; the ring makes the sender wait instead.
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../proto.h"
+#include "../shm.h"
+#include "../stats.h"
+
+#define PORT_A 7611
+#define PORT_B 7612
+
+//receiver gives up once the sender is done and nothing arrived for this long (loopback drops)
+#define IDLE_TIMEOUT_MS 200
+
+typedef struct End_s End;
+struct End_s {
+    bool useShm;
+    int port;
+    int peerPort;
+    int udp;
+    struct sockaddr_in to;
+    int listenFd;
+    ShmRing rx;  // ours, the other end writes into it
+    int rxConn;
+    ShmRing tx;  // the other end's
+    int txConn;
+};
+
+static void setup(End* end, bool useShm, int port, int peerPort) {
+    memset(end, 0, sizeof(*end));
+    end -> useShm = useShm;
+    end -> port = port;
+    end -> peerPort = peerPort;
+    end -> udp = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(end -> udp, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+    int rcvbuf = 1 << 20;
+    setsockopt(end -> udp, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    end -> to = addr;
+    end -> to.sin_port = htons(peerPort);
+    end -> rx.eventFd = end -> tx.eventFd = -1;
+    end -> rxConn = end -> txConn = -1;
+    end -> listenFd = useShm ? Shm_listen(port) : -1;
+    if (useShm && end -> listenFd < 0) {
+        perror("Shm_listen");
+        exit(EXIT_FAILURE);
+    }
+}
+
+//Both ends listen first, then each connects to the other while the other accepts
+static void* connectEnd(void* arg) {
+    End* end = arg;
+    end -> txConn = Shm_connect(end -> peerPort, &end -> tx);
+    return NULL;
+}
+
+static void connectShm(End* a, End* b) {
+    pthread_t ta, tb;
+    pthread_create(&ta, NULL, connectEnd, a);
+    pthread_create(&tb, NULL, connectEnd, b);
+    End* ends[2] = { a, b };
+    for (int i = 0; i < 2; i++) {
+        struct pollfd pfd = { ends[i] -> listenFd, POLLIN, 0 };
+        poll(&pfd, 1, 1000);
+        ends[i] -> rxConn = Shm_accept(ends[i] -> listenFd, &ends[i] -> rx);
+    }
+    pthread_join(ta, NULL);
+    pthread_join(tb, NULL);
+    if (a -> txConn < 0 || b -> txConn < 0 || a -> rxConn < 0 || b -> rxConn < 0) {
+        fprintf(stderr, "shared memory connection failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void teardown(End* end) {
+    if (end -> useShm) {
+        Shm_release(&end -> rx);
+        Shm_release(&end -> tx);
+        close(end -> rxConn);
+        close(end -> txConn);
+        close(end -> listenFd);
+    }
+    close(end -> udp);
+}
+
+static void sendOne(End* end, const char* data, size_t len) {
+    if (!end -> useShm) {
+        sendto(end -> udp, data, len, 0, (struct sockaddr *)&end -> to, sizeof(end -> to));
+        return;
+    }
+    while (!ShmRing_write(&end -> tx, data, len)) {
+        sched_yield();
+    }
+}
+
+//Blocks for the next datagram (up to timeoutMs, -1 = forever). Returns its length, 0 on timeout.
+static ssize_t receiveOne(End* end, char* buf, size_t cap, int timeoutMs) {
+    if (!end -> useShm) {
+        struct pollfd pfd = { end -> udp, POLLIN, 0 };
+        if (timeoutMs >= 0 && poll(&pfd, 1, timeoutMs) <= 0) {
+            return 0;
+        }
+        return recv(end -> udp, buf, cap, 0);
+    }
+    while (1) {
+        ssize_t len = ShmRing_read(&end -> rx, buf, cap);
+        if (len != 0) {
+            return len;
+        }
+        if (!ShmRing_prepare_wait(&end -> rx)) {
+            continue;
+        }
+        struct pollfd pfd = { end -> rx.eventFd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeoutMs);
+        ShmRing_finish_wait(&end -> rx);
+        if (ready == 0) {
+            return ShmRing_read(&end -> rx, buf, cap);
+        }
+    }
+}
+
+typedef struct Run_s Run;
+struct Run_s {
+    End* end;
+    int count;
+    int size;
+    long received;
+};
+
+//The far end of the latency test: sends every datagram straight back
+static void* echo(void* arg) {
+    Run* run = arg;
+    char buf[PROTO_MAX_DATAGRAM];
+    for (int i = 0; i < run -> count; i++) {
+        ssize_t len = receiveOne(run -> end, buf, sizeof(buf), -1);
+        sendOne(run -> end, buf, (size_t)len);
+    }
+    return NULL;
+}
+
+//The far end of the throughput test: counts datagrams until the sender has stopped
+static void* sink(void* arg) {
+    Run* run = arg;
+    char buf[PROTO_MAX_DATAGRAM];
+    while (run -> received < run -> count && receiveOne(run -> end, buf, sizeof(buf), IDLE_TIMEOUT_MS) > 0) {
+        run -> received++;
+    }
+    return NULL;
+}
+
+static void bench(bool useShm, int roundTrips, int datagrams, int size) {
+    const char* name = useShm ? "shm" : "udp";
+    char buf[PROTO_MAX_DATAGRAM];
+    memset(buf, 'x', sizeof(buf));
+    End a, b;
+    setup(&a, useShm, PORT_A, PORT_B);
+    setup(&b, useShm, PORT_B, PORT_A);
+    if (useShm) {
+        connectShm(&a, &b);
+    }
+
+    static Hist rtt;
+    memset(&rtt, 0, sizeof(rtt));
+    Run far = { &b, roundTrips, 64, 0 };
+    pthread_t thread;
+    pthread_create(&thread, NULL, echo, &far);
+    uint64_t start = Proto_now_ns();
+    for (int i = 0; i < roundTrips; i++) {
+        uint64_t sent = Proto_now_ns();
+        sendOne(&a, buf, 64);
+        receiveOne(&a, buf, sizeof(buf), -1);
+        Hist_record(&rtt, Proto_now_ns() - sent);
+    }
+    double secs = (double)(Proto_now_ns() - start) / 1e9;
+    pthread_join(thread, NULL);
+    printf("%s latency:    %d round trips, mean %.1f us, p50 <%.1f us, p99 <%.1f us, max %.1f us (%.0f/s)\n",
+           name, roundTrips, (double)rtt.sumNs / roundTrips / 1e3,
+           Hist_percentile(&rtt, 50) / 1e3, Hist_percentile(&rtt, 99) / 1e3, (double)rtt.maxNs / 1e3,
+           roundTrips / secs);
+
+    far = (Run){ &b, datagrams, size, 0 };
+    pthread_create(&thread, NULL, sink, &far);
+    start = Proto_now_ns();
+    for (int i = 0; i < datagrams; i++) {
+        sendOne(&a, buf, (size_t)size);
+    }
+    pthread_join(thread, NULL);
+    //the sink waited out the idle timeout if anything was lost, don't count that
+    secs = (double)(Proto_now_ns() - start) / 1e9 - (far.received < datagrams ? IDLE_TIMEOUT_MS / 1e3 : 0);
+    printf("%s throughput: %ld/%d datagrams of %d bytes arrived, %.0f datagrams/s, %.1f MB/s\n",
+           name, far.received, datagrams, size, far.received / secs, far.received * (double)size / secs / 1e6);
+
+    teardown(&a);
+    teardown(&b);
+}
+
+int main(int argc, char *argv[]) {
+    int roundTrips = argc > 1 ? atoi(argv[1]) : 100000;
+    int datagrams = argc > 2 ? atoi(argv[2]) : 1000000;
+    int size = argc > 3 ? atoi(argv[3]) : 1400;
+    if (size < 1 || size > PROTO_MAX_DATAGRAM) {
+        fprintf(stderr, "datagram size must be 1..%d\n", PROTO_MAX_DATAGRAM);
+        return 1;
+    }
+    bench(false, roundTrips, datagrams, size);
+    bench(true, roundTrips, datagrams, size);
+    return 0;
+}
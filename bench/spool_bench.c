@@ -0,0 +1,125 @@
+// Spool throughput and recovery: group commit size vs. lines per second, and restart time.
+//
+// usage: spool_bench [lines] [line bytes] [dir]
+//
+// For each group size, appends lines to a fresh spool in the given directory (default
+// /tmp/spool_bench.d, wiped first), calling Spool_sync after every group the way s-talk-relay does
+// after every burst of datagrams. Then reopens the spool and times the recovery, and reads and
+// acknowledges everything back in 32 line windows. The last run also cuts a few bytes off the
+// newest segment to show a torn tail being dropped on open.
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../proto.h"
+#include "../spool.h"
+
+static void wipe(const char* path) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent* entry;
+    char name[4096];
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry -> d_name[0] != '.') {
+            snprintf(name, sizeof(name), "%s/%s", path, entry -> d_name);
+            unlink(name);
+        }
+    }
+    closedir(dir);
+}
+
+static double seconds(uint64_t startNs) {
+    return (double)(Proto_now_ns() - startNs) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    long lines = argc > 1 ? atol(argv[1]) : 200000;
+    int lineBytes = argc > 2 ? atoi(argv[2]) : 40;
+    const char* path = argc > 3 ? argv[3] : "/tmp/spool_bench.d";
+    if (lineBytes < 1 || lineBytes > SPOOL_MAX_RECORD) {
+        fprintf(stderr, "line bytes must be 1..%d\n", SPOOL_MAX_RECORD);
+        return 1;
+    }
+    char* line = malloc(lineBytes);
+    char* back = malloc(SPOOL_MAX_RECORD);
+    memset(line, 'x', lineBytes);
+
+    const int groups[] = { 1, 8, 64, 512 };
+    int groupCount = sizeof(groups) / sizeof(groups[0]);
+    for (int g = 0; g < groupCount; g++) {
+        wipe(path);
+        Spool spool;
+        if (Spool_open(&spool, path) < 0) {
+            perror("Spool_open");
+            return 1;
+        }
+        //fewer lines for tiny groups, every one of those is an fdatasync
+        long n = groups[g] == 1 ? (lines < 5000 ? lines : 5000) : lines;
+        uint64_t start = Proto_now_ns();
+        for (long i = 0; i < n; i++) {
+            Spool_append(&spool, line, lineBytes);
+            if ((i + 1) % groups[g] == 0) {
+                Spool_sync(&spool);
+            }
+        }
+        Spool_sync(&spool);
+        double appendSecs = seconds(start);
+        uint64_t syncs = spool.syncs;
+        Spool_close(&spool);
+
+        //the last run tears the newest segment, as a crash in the middle of a write would
+        bool tear = g == groupCount - 1;
+        if (tear) {
+            DIR* dir = opendir(path);
+            struct dirent* entry;
+            char newest[4096] = "";
+            while ((entry = readdir(dir)) != NULL) {
+                if (strstr(entry -> d_name, ".seg") != NULL && strcmp(entry -> d_name, newest) > 0) {
+                    snprintf(newest, sizeof(newest), "%s", entry -> d_name);
+                }
+            }
+            closedir(dir);
+            char name[8192];
+            snprintf(name, sizeof(name), "%s/%s", path, newest);
+            struct stat st;
+            stat(name, &st);
+            truncate(name, st.st_size - 3);
+        }
+
+        start = Proto_now_ns();
+        if (Spool_open(&spool, path) < 0) {
+            perror("Spool_open");
+            return 1;
+        }
+        double recoverSecs = seconds(start);
+        uint64_t pending = Spool_pending(&spool);
+
+        start = Proto_now_ns();
+        long read = 0;
+        while (Spool_read(&spool, back, SPOOL_MAX_RECORD) > 0) {
+            if (++read % 32 == 0) {
+                Spool_ack(&spool);
+            }
+        }
+        Spool_ack(&spool);
+        double readSecs = seconds(start);
+
+        printf("group %3d: append %8.0f lines/s (%llu syncs), recover %.2f ms (%llu lines", groups[g],
+               n / appendSecs, (unsigned long long)syncs, recoverSecs * 1e3, (unsigned long long)pending);
+        if (tear) {
+            printf(", %llu torn bytes dropped", (unsigned long long)spool.recoveredBytes);
+        }
+        printf("), read+ack %9.0f lines/s\n", read / readSecs);
+        Spool_close(&spool);
+    }
+    wipe(path);
+    rmdir(path);
+    free(line);
+    free(back);
+    return 0;
+}
@@ -0,0 +1,213 @@
+// Compares the plain syscall path with the io_uring backend over UDP loopback.
+//
+// usage: uring_bench [messages] [message size]
+//
+// Both modes push the same number of chat sized datagrams from a sender thread to a receiver
+// thread. The syscall mode does one sendto/recvfrom per datagram like the original s-talk;
+// the io_uring mode submits sends in batches and keeps a multishot recvmsg armed on the
+// receiving socket. Reports throughput and syscalls per message for each.
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../proto.h"
+#include "../uring.h"
+
+#define BATCH 32
+#define RECV_BUFFERS 256
+#define GROUP 1
+
+typedef struct Run_s Run;
+struct Run_s {
+    bool useRing;
+    int messages;
+    int size;
+    int rxSocket;
+    struct sockaddr_in rxAddr;
+    int received;
+    uint64_t txSyscalls;
+    uint64_t rxSyscalls;
+    volatile bool senderDone;
+};
+
+//receiver gives up once the sender is done and nothing arrived for this long (loopback drops)
+#define IDLE_TIMEOUT_US 200000
+
+static void* sender(void* arg) {
+    Run* run = arg;
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    char payload[PROTO_MAX_DATAGRAM];
+    memset(payload, 'x', sizeof(payload));
+
+    if (!run -> useRing) {
+        for (int i = 0; i < run -> messages; i++) {
+            sendto(s, payload, run -> size, 0, (struct sockaddr *)&run -> rxAddr, sizeof(run -> rxAddr));
+            run -> txSyscalls++;
+        }
+    } else {
+        Uring ring;
+        if (Uring_init(&ring, BATCH * 2) < 0) {
+            perror("io_uring");
+            exit(EXIT_FAILURE);
+        }
+        struct msghdr msgs[BATCH];
+        struct iovec iov = { payload, (size_t)run -> size };
+        for (int i = 0; i < BATCH; i++) {
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_name = &run -> rxAddr;
+            msgs[i].msg_namelen = sizeof(run -> rxAddr);
+            msgs[i].msg_iov = &iov;
+            msgs[i].msg_iovlen = 1;
+        }
+        for (int sent = 0; sent < run -> messages; ) {
+            int n = run -> messages - sent < BATCH ? run -> messages - sent : BATCH;
+            for (int i = 0; i < n; i++) {
+                Uring_prep_sendmsg(Uring_get_sqe(&ring), s, &msgs[i], 0);
+            }
+            Uring_submit(&ring, (unsigned)n);
+            for (int done = 0; done < n; ) {
+                if (Uring_peek_cqe(&ring) == NULL) {
+                    Uring_submit(&ring, (unsigned)(n - done));
+                    continue;
+                }
+                Uring_cqe_seen(&ring);
+                done++;
+            }
+            sent += n;
+        }
+        run -> txSyscalls = ring.enterCalls;
+        Uring_exit(&ring);
+    }
+    close(s);
+    run -> senderDone = true;
+    return NULL;
+}
+
+static void* receiver(void* arg) {
+    Run* run = arg;
+    struct timeval tv = { 0, IDLE_TIMEOUT_US };
+    char buffer[PROTO_MAX_DATAGRAM];
+
+    if (!run -> useRing) {
+        setsockopt(run -> rxSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        while (run -> received < run -> messages) {
+            run -> rxSyscalls++;
+            if (recv(run -> rxSocket, buffer, sizeof(buffer), 0) < 0) {
+                if (run -> senderDone) {
+                    break;
+                }
+                continue;
+            }
+            run -> received++;
+        }
+        return NULL;
+    }
+
+    Uring ring;
+    struct msghdr layout;
+    memset(&layout, 0, sizeof(layout));
+    layout.msg_namelen = sizeof(struct sockaddr_storage);
+    unsigned bufferSize = sizeof(struct io_uring_recvmsg_out) + layout.msg_namelen + PROTO_MAX_DATAGRAM;
+    if (Uring_init(&ring, BATCH * 2) < 0 || Uring_setup_buffers(&ring, RECV_BUFFERS, bufferSize, GROUP) < 0) {
+        perror("io_uring");
+        exit(EXIT_FAILURE);
+    }
+
+    bool armed = false;
+    struct __kernel_timespec idle = { 0, IDLE_TIMEOUT_US * 1000ll };
+    while (run -> received < run -> messages) {
+        if (!armed) {
+            Uring_prep_recvmsg_multishot(Uring_get_sqe(&ring), run -> rxSocket, &layout, GROUP, 1);
+            armed = true;
+        }
+        //a timeout entry lets the loop notice a finished sender that lost datagrams
+        struct io_uring_sqe* sqe = Uring_get_sqe(&ring);
+        sqe -> opcode = IORING_OP_TIMEOUT;
+        sqe -> addr = (uint64_t)(uintptr_t)&idle;
+        sqe -> len = 1;
+        sqe -> off = 1; //also completes as soon as any other completion is posted
+        sqe -> user_data = 2;
+        Uring_submit(&ring, 1);
+
+        bool timedOut = false;
+        struct io_uring_cqe* cqe;
+        while ((cqe = Uring_peek_cqe(&ring)) != NULL) {
+            if (cqe -> user_data == 2) {
+                timedOut = cqe -> res == -ETIME;
+            } else {
+                if (!(cqe -> flags & IORING_CQE_F_MORE)) {
+                    armed = false;
+                }
+                if (cqe -> res >= 0 && (cqe -> flags & IORING_CQE_F_BUFFER)) {
+                    run -> received++;
+                    Uring_recycle_buffer(&ring, cqe -> flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+            }
+            Uring_cqe_seen(&ring);
+        }
+        if (timedOut && run -> senderDone) {
+            break;
+        }
+    }
+    run -> rxSyscalls = ring.enterCalls;
+    Uring_exit(&ring);
+    return NULL;
+}
+
+static void runOnce(bool useRing, int messages, int size) {
+    Run run;
+    memset(&run, 0, sizeof(run));
+    run.useRing = useRing;
+    run.messages = messages;
+    run.size = size;
+
+    run.rxSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    int rcvbuf = 8 << 20;
+    setsockopt(run.rxSocket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    run.rxAddr.sin_family = AF_INET;
+    run.rxAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(run.rxAddr);
+    bind(run.rxSocket, (struct sockaddr *)&run.rxAddr, sizeof(run.rxAddr));
+    getsockname(run.rxSocket, (struct sockaddr *)&run.rxAddr, &addrLen);
+
+    pthread_t tx, rx;
+    uint64_t start = Proto_now_ns();
+    pthread_create(&rx, NULL, receiver, &run);
+    pthread_create(&tx, NULL, sender, &run);
+    pthread_join(tx, NULL);
+    pthread_join(rx, NULL);
+    double seconds = (double)(Proto_now_ns() - start) / 1e9;
+    close(run.rxSocket);
+
+    printf("%-8s %9d sent %9d received %10.0f msg/s   tx %.3f rx %.3f syscalls/msg\n",
+           useRing ? "io_uring" : "syscall", messages, run.received, run.received / seconds,
+           (double)run.txSyscalls / messages, run.received > 0 ? (double)run.rxSyscalls / run.received : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    int messages = argc > 1 ? atoi(argv[1]) : 200000;
+    int size = argc > 2 ? atoi(argv[2]) : 48;
+    if (size < 1 || size > PROTO_MAX_DATAGRAM) {
+        fprintf(stderr, "message size must be 1..%d\n", PROTO_MAX_DATAGRAM);
+        return 1;
+    }
+
+    Uring probe;
+    bool haveRing = Uring_init(&probe, 4) == 0;
+    if (haveRing) {
+        Uring_exit(&probe);
+    }
+
+    runOnce(false, messages, size);
+    if (haveRing) {
+        runOnce(true, messages, size);
+    } else {
+        printf("io_uring  not available on this kernel (%s)\n", strerror(errno));
+    }
+    return 0;
+}
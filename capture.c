@@ -0,0 +1,143 @@
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include "capture.h"
+#include "proto.h"
+
+//Capture state shared by the send and receive threads
+static FILE* captureFile = NULL;
+static uint64_t lastRecordNs = 0;
+static uint64_t lastFlushNs = 0;
+static pthread_mutex_t captureMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//Big stdio buffer so a busy capture costs a memcpy per datagram, not a write
+#define CAPTURE_BUFFER (1 << 20)
+
+//A quiet capture is still written out this often, so a crash loses at most this much of it
+#define CAPTURE_FLUSH_NS 1000000000ull
+
+//Writes v as a LEB128 varint, returns the number of bytes used
+static size_t putVarint(unsigned char* out, uint64_t v) {
+    size_t n = 0;
+    do {
+        unsigned char byte = v & 0x7f;
+        v >>= 7;
+        out[n++] = byte | (v != 0 ? 0x80 : 0);
+    } while (v != 0);
+    return n;
+}
+
+static bool getVarint(FILE* file, uint64_t* pValue) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(file);
+        if (c == EOF) {
+            return false;
+        }
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *pValue = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+int Capture_open(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER);
+    if (fwrite(CAPTURE_MAGIC, 1, 8, file) != 8) {
+        int saved = errno;
+        fclose(file);
+        errno = saved;
+        return -1;
+    }
+    pthread_mutex_lock(&captureMutex);
+    captureFile = file;
+    lastRecordNs = 0;
+    lastFlushNs = Proto_now_ns();
+    pthread_mutex_unlock(&captureMutex);
+    return 0;
+}
+
+bool Capture_active(void) {
+    return __atomic_load_n(&captureFile, __ATOMIC_RELAXED) != NULL;
+}
+
+void Capture_record(enum CaptureDir dir, const char* data, size_t len) {
+    if (!Capture_active()) {
+        return;
+    }
+    unsigned char header[1 + 10 + 10];
+
+    pthread_mutex_lock(&captureMutex);
+    if (captureFile != NULL) {
+        //read under the lock: the send and receive threads must write records in clock order
+        uint64_t now = Proto_now_ns();
+        //the first record starts the clock, so its delta is 0
+        uint64_t delta = lastRecordNs != 0 ? now - lastRecordNs : 0;
+        lastRecordNs = now;
+        size_t n = 0;
+        header[n++] = (unsigned char)dir;
+        n += putVarint(header + n, delta);
+        n += putVarint(header + n, len);
+        fwrite(header, 1, n, captureFile);
+        fwrite(data, 1, len, captureFile);
+        if (now - lastFlushNs >= CAPTURE_FLUSH_NS) {
+            fflush(captureFile);
+            lastFlushNs = now;
+        }
+    }
+    pthread_mutex_unlock(&captureMutex);
+}
+
+void Capture_close(void) {
+    pthread_mutex_lock(&captureMutex);
+    if (captureFile != NULL) {
+        fclose(captureFile);
+        captureFile = NULL;
+    }
+    pthread_mutex_unlock(&captureMutex);
+}
+
+int Capture_reader_open(CaptureReader* pReader, const char* path) {
+    char magic[8];
+    pReader -> timeNs = 0;
+    pReader -> file = fopen(path, "rb");
+    if (pReader -> file == NULL) {
+        return -1;
+    }
+    if (fread(magic, 1, 8, pReader -> file) != 8 || memcmp(magic, CAPTURE_MAGIC, 8) != 0) {
+        fclose(pReader -> file);
+        pReader -> file = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+bool Capture_next(CaptureReader* pReader, CaptureRecord* pRecord) {
+    int dir = fgetc(pReader -> file);
+    uint64_t delta, len;
+    if (dir == EOF || !getVarint(pReader -> file, &delta) || !getVarint(pReader -> file, &len)) {
+        return false;
+    }
+    if (len > CAPTURE_MAX_DATAGRAM || fread(pRecord -> data, 1, len, pReader -> file) != len) {
+        return false;
+    }
+    pReader -> timeNs += delta;
+    pRecord -> dir = (enum CaptureDir)dir;
+    pRecord -> timeNs = pReader -> timeNs;
+    pRecord -> len = (size_t)len;
+    return true;
+}
+
+void Capture_reader_close(CaptureReader* pReader) {
+    if (pReader -> file != NULL) {
+        fclose(pReader -> file);
+        pReader -> file = NULL;
+    }
+}
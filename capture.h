@@ -0,0 +1,64 @@
+// Traffic capture for offline load testing
+//
+// With -c, sendMsgThread and getMsgThread log every datagram they send or receive, with its
+// timing, to a compact binary file that s-talk-replay can re-inject later.
+//
+// File layout: the 8 byte magic "STKCAP01", then one record per datagram:
+//   direction (1 byte, CAPTURE_SENT or CAPTURE_RECEIVED)
+//   nanoseconds since the previous record (LEB128 varint)
+//   datagram length (LEB128 varint)
+//   the datagram bytes, exactly as they were on the wire
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "STKCAP01"
+#define CAPTURE_MAX_DATAGRAM 65536
+
+enum CaptureDir {
+    CAPTURE_SENT = 1,
+    CAPTURE_RECEIVED = 2
+};
+
+// Starts capturing into path (truncating it). Returns 0 on success, -1 on failure (errno set).
+int Capture_open(const char* path);
+
+// True once Capture_open succeeded and until Capture_close
+bool Capture_active(void);
+
+// Appends one datagram to the capture. Safe to call from any thread; does nothing if no
+// capture is open.
+void Capture_record(enum CaptureDir dir, const char* data, size_t len);
+
+// Flushes and closes the capture file. s-talk also calls it when SIGINT/SIGTERM/SIGHUP
+// arrive, since the buffered tail would otherwise be lost.
+void Capture_close(void);
+
+// Reading a capture back (used by s-talk-replay)
+typedef struct CaptureReader_s CaptureReader;
+struct CaptureReader_s {
+    FILE* file;
+    uint64_t timeNs; // time of the last record read, relative to the first record
+};
+
+typedef struct CaptureRecord_s CaptureRecord;
+struct CaptureRecord_s {
+    enum CaptureDir dir;
+    uint64_t timeNs; // relative to the first record in the file
+    size_t len;
+    char data[CAPTURE_MAX_DATAGRAM];
+};
+
+// Opens a capture for reading. Returns 0 on success, -1 if it can't be opened or isn't a capture.
+int Capture_reader_open(CaptureReader* pReader, const char* path);
+
+// Reads the next record. Returns false at the end of the file or on a truncated record.
+bool Capture_next(CaptureReader* pReader, CaptureRecord* pRecord);
+
+void Capture_reader_close(CaptureReader* pReader);
+
+#endif
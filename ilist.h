@@ -0,0 +1,117 @@
+// Intrusive doubly linked list
+//
+// Unlike List, which takes a Node from the shared nodeArr pool and points it at the item, the
+// link fields of an intrusive list live inside the item itself. Pushing and popping never
+// allocates and never runs out of nodes; the item and its links share one allocation and
+// usually one cache line.
+//
+// Embed an IListLink in the struct, then generate typed helpers with ILIST_DEFINE:
+//
+//     struct Message_s { IListLink link; ... };
+//     ILIST_DEFINE(MessageList, Message, link)
+//
+//     MessageList_push(&list, message);
+//     Message* next = MessageList_pop(&list);
+//
+// An item can be on at most one list per embedded link at a time.
+
+#ifndef _ILIST_H_
+#define _ILIST_H_
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct IListLink_s IListLink;
+struct IListLink_s {
+    struct IListLink_s *next;
+    struct IListLink_s *prev;
+};
+
+// Circular list with a sentinel head, so linking and unlinking need no NULL checks
+typedef struct IList_s IList;
+struct IList_s {
+    IListLink head;
+    int count;
+};
+
+// Converts a pointer to an embedded link back to the struct containing it
+#define ILIST_ENTRY(pLink, type, member) ((type *)((char *)(pLink) - offsetof(type, member)))
+
+// Makes pList empty
+static inline void IList_init(IList* pList) {
+    pList -> head.next = &pList -> head;
+    pList -> head.prev = &pList -> head;
+    pList -> count = 0;
+}
+
+static inline int IList_count(const IList* pList) {
+    return pList -> count;
+}
+
+static inline bool IList_empty(const IList* pList) {
+    return pList -> head.next == &pList -> head;
+}
+
+// Links pLink in between two neighbours that are next to each other
+static inline void IList_link_between(IList* pList, IListLink* pLink, IListLink* pPrev, IListLink* pNext) {
+    pLink -> prev = pPrev;
+    pLink -> next = pNext;
+    pPrev -> next = pLink;
+    pNext -> prev = pLink;
+    pList -> count++;
+}
+
+// Adds pLink to the end of pList
+static inline void IList_push_back(IList* pList, IListLink* pLink) {
+    IList_link_between(pList, pLink, pList -> head.prev, &pList -> head);
+}
+
+// Adds pLink to the front of pList
+static inline void IList_push_front(IList* pList, IListLink* pLink) {
+    IList_link_between(pList, pLink, &pList -> head, pList -> head.next);
+}
+
+// Takes pLink (which must be on pList) out of pList
+static inline void IList_unlink(IList* pList, IListLink* pLink) {
+    pLink -> prev -> next = pLink -> next;
+    pLink -> next -> prev = pLink -> prev;
+    pLink -> next = NULL;
+    pLink -> prev = NULL;
+    pList -> count--;
+}
+
+// First link of pList, or NULL if it is empty
+static inline IListLink* IList_first(const IList* pList) {
+    return IList_empty(pList) ? NULL : pList -> head.next;
+}
+
+// Removes and returns the first link of pList, or NULL if it is empty
+static inline IListLink* IList_pop_front(IList* pList) {
+    IListLink* pLink = IList_first(pList);
+    if (pLink != NULL) {
+        IList_unlink(pList, pLink);
+    }
+    return pLink;
+}
+
+// Generates type safe wrappers name_push/name_push_front/name_first/name_pop/name_remove for
+// lists of type linked through its member field
+#define ILIST_DEFINE(name, type, member)                                            \
+    static inline void name##_push(IList* pList, type* pItem) {                     \
+        IList_push_back(pList, &pItem -> member);                                   \
+    }                                                                               \
+    static inline void name##_push_front(IList* pList, type* pItem) {               \
+        IList_push_front(pList, &pItem -> member);                                  \
+    }                                                                               \
+    static inline type* name##_first(const IList* pList) {                          \
+        IListLink* pLink = IList_first(pList);                                      \
+        return pLink != NULL ? ILIST_ENTRY(pLink, type, member) : NULL;             \
+    }                                                                               \
+    static inline type* name##_pop(IList* pList) {                                  \
+        IListLink* pLink = IList_pop_front(pList);                                  \
+        return pLink != NULL ? ILIST_ENTRY(pLink, type, member) : NULL;             \
+    }                                                                               \
+    static inline void name##_remove(IList* pList, type* pItem) {                   \
+        IList_unlink(pList, &pItem -> member);                                      \
+    }
+
+#endif
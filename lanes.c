@@ -0,0 +1,169 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lanes.h"
+
+//Tells the CPU we are in a spin loop (saves power and lets a sibling hyperthread run)
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX() do {} while (0)
+#endif
+
+static const int laneWeight[LANE_COUNT] = { 0, LANE_INTERACTIVE_WEIGHT, LANE_BULK_WEIGHT };
+
+//Takes the oldest message off one lane
+static Message* popLane(Lanes* pLanes, enum Lane lane) {
+    Message* message = MessageList_pop(&pLanes -> lists[lane]);
+    if (message != NULL) {
+        __atomic_store_n(&pLanes -> count, pLanes -> count - 1, __ATOMIC_RELEASE);
+        if (lane != LANE_CONTROL) {
+            pLanes -> dataCount--;
+        }
+        if (message -> type == PROTO_PONG) {
+            pLanes -> pongCount--;
+        }
+        if (message == pLanes -> pendingPong) {
+            pLanes -> pendingPong = NULL;
+        }
+    }
+    return message;
+}
+
+//Moves the round robin on to the other data lane
+static void nextTurn(Lanes* pLanes) {
+    pLanes -> turn = pLanes -> turn == LANE_INTERACTIVE ? LANE_BULK : LANE_INTERACTIVE;
+    pLanes -> granted = false;
+}
+
+int Lanes_init(Lanes* pLanes) {
+    for (int i = 0; i < LANE_COUNT; i++) {
+        IList_init(&pLanes -> lists[i]);
+        pLanes -> deficit[i] = 0;
+    }
+    pLanes -> turn = LANE_INTERACTIVE;
+    pLanes -> granted = false;
+    pLanes -> count = 0;
+    pLanes -> dataCount = 0;
+    pLanes -> maxData = LANES_MAX_DATA;
+    pLanes -> pendingPong = NULL;
+    pLanes -> pongCount = 0;
+    return LIST_SUCCESS;
+}
+
+enum Lane Lanes_classify(const Message* message) {
+    if (message -> type != PROTO_TEXT) {
+        return LANE_CONTROL;
+    }
+    return message -> bulk ? LANE_BULK : LANE_INTERACTIVE;
+}
+
+int Lanes_push(Lanes* pLanes, Message* message) {
+    enum Lane lane = Lanes_classify(message);
+    if (lane == LANE_CONTROL) {
+        //past the limit the peer only gets the newest probe echoed, enough to measure the round trip
+        Message* pending = pLanes -> pendingPong;
+        if (message -> type == PROTO_PONG && pLanes -> pongCount >= LANES_MAX_PONGS && pending != NULL
+                && pending -> len == message -> len) {
+            memcpy(pending -> data, message -> data, message -> len);
+            free(message);
+            return LIST_SUCCESS;
+        }
+        if (pLanes -> count - pLanes -> dataCount >= LANES_MAX_CONTROL) {
+            return LIST_FAIL;
+        }
+        if (message -> type == PROTO_PONG) {
+            pLanes -> pendingPong = message;
+            pLanes -> pongCount++;
+        }
+    } else if (pLanes -> dataCount >= pLanes -> maxData) {
+        return LIST_FAIL;
+    }
+    MessageList_push(&pLanes -> lists[lane], message);
+    message -> queuedNs = Proto_now_ns();
+    //count is also peeked at without the lock by threads spinning for work
+    __atomic_store_n(&pLanes -> count, pLanes -> count + 1, __ATOMIC_RELEASE);
+    if (lane != LANE_CONTROL) {
+        pLanes -> dataCount++;
+    }
+    return LIST_SUCCESS;
+}
+
+Message* Lanes_pop(Lanes* pLanes) {
+    //strict priority for control traffic
+    if (!IList_empty(&pLanes -> lists[LANE_CONTROL])) {
+        return popLane(pLanes, LANE_CONTROL);
+    }
+    if (pLanes -> dataCount == 0) {
+        return NULL;
+    }
+
+    //deficit round robin: a lane earns its quantum once per visit and is served while
+    //the message at its head fits in the credit it has built up
+    while (1) {
+        enum Lane lane = pLanes -> turn;
+        IList* list = &pLanes -> lists[lane];
+        if (IList_empty(list)) {
+            //idle lanes don't bank credit
+            pLanes -> deficit[lane] = 0;
+            nextTurn(pLanes);
+            continue;
+        }
+        if (!pLanes -> granted) {
+            pLanes -> deficit[lane] += LANE_QUANTUM * laneWeight[lane];
+            pLanes -> granted = true;
+        }
+        Message* head = MessageList_first(list);
+        if (head -> len <= pLanes -> deficit[lane]) {
+            pLanes -> deficit[lane] -= head -> len;
+            return popLane(pLanes, lane);
+        }
+        nextTurn(pLanes);
+    }
+}
+
+int Lanes_count(Lanes* pLanes) {
+    return pLanes -> count;
+}
+
+bool Lanes_peek_nonempty(Lanes* pLanes) {
+    return __atomic_load_n(&pLanes -> count, __ATOMIC_ACQUIRE) > 0;
+}
+
+bool Lanes_spin(Lanes* pLanes, uint64_t budgetNs, const bool* pStop) {
+    if (budgetNs == 0) {
+        return false;
+    }
+    uint64_t deadline = Proto_now_ns() + budgetNs;
+    do {
+        //only look at the clock every so often, it costs more than the peek
+        for (int i = 0; i < 64; i++) {
+            if (Lanes_peek_nonempty(pLanes) || __atomic_load_n(pStop, __ATOMIC_RELAXED)) {
+                return true;
+            }
+            CPU_RELAX();
+        }
+    } while (Proto_now_ns() < deadline);
+    return false;
+}
+
+bool Lanes_has_room(Lanes* pLanes) {
+    return pLanes -> dataCount < pLanes -> maxData;
+}
+
+void Lanes_free(Lanes* pLanes, FREE_FN pItemFreeFn) {
+    for (int i = 0; i < LANE_COUNT; i++) {
+        Message* message;
+        while ((message = MessageList_pop(&pLanes -> lists[i])) != NULL) {
+            if (pItemFreeFn != NULL) {
+                (*pItemFreeFn)(message);
+            }
+        }
+    }
+    pLanes -> count = 0;
+    pLanes -> dataCount = 0;
+    pLanes -> pendingPong = NULL;
+    pLanes -> pongCount = 0;
+}
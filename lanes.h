@@ -0,0 +1,94 @@
+// Priority lanes for sendList and receiveList
+//
+// Each direction keeps one intrusive list of messages per lane. Control messages (heartbeats, goodbyes, status
+// notices) are always served first. The data lanes share what is left with deficit round
+// robin weighted by bytes, so a big paste in the bulk lane cannot starve ordinary chat lines
+// and ordinary chat cannot starve the paste either. Lines within one lane stay in order, so the
+// producer picks a data lane (Message.bulk) once per burst of input: a paste, and every piece
+// of its long lines, shares one lane. A line typed while a paste is still draining may
+// overtake it. receiveList only ever gets interactive messages, so the screen shows chat in the
+// order it arrived.
+
+#ifndef _LANES_H_
+#define _LANES_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include "ilist.h"
+#include "list.h"
+#include "proto.h"
+
+enum Lane {
+    LANE_CONTROL,
+    LANE_INTERACTIVE,
+    LANE_BULK,
+    LANE_COUNT
+};
+
+// A burst of input that starts with a piece this long (or with more input already waiting)
+// goes to the bulk lane
+#define LANE_BULK_THRESHOLD 512
+
+// Input read less than this long after the previous piece belongs to the same burst
+#define LANE_BURST_GAP_NS 2000000ull
+
+// Bytes of credit a data lane earns per round, multiplied by the lane's weight
+#define LANE_QUANTUM 512
+#define LANE_INTERACTIVE_WEIGHT 4
+#define LANE_BULK_WEIGHT 1
+
+// Data messages one direction may hold before producers have to wait (the default for
+// Lanes.maxData)
+#define LANES_MAX_DATA 256
+
+// Control messages one direction may hold. Past LANES_MAX_PONGS pending PONGs, a new one only
+// replaces the newest one's probe, so a peer flooding us with PINGs can't fill the control lane.
+// Below that every PING gets its own PONG: s-talk-relay counts them to confirm its window.
+#define LANES_MAX_CONTROL 64
+#define LANES_MAX_PONGS 48
+
+typedef struct Lanes_s Lanes;
+struct Lanes_s {
+    IList lists[LANE_COUNT];
+    int deficit[LANE_COUNT];
+    enum Lane turn;   // data lane currently being served
+    bool granted;     // turn already received its quantum for this visit
+    int count;        // messages across all lanes
+    int dataCount;    // messages in the data lanes
+    int maxData;      // data messages held before Lanes_push refuses more
+    Message* pendingPong; // the newest PONG waiting in the control lane, if any
+    int pongCount;        // PONGs waiting in the control lane
+};
+
+// Empties every lane and sets maxData to LANES_MAX_DATA. Returns LIST_SUCCESS.
+int Lanes_init(Lanes* pLanes);
+
+// Lane a message belongs in
+enum Lane Lanes_classify(const Message* message);
+
+// Adds message to the back of its lane without allocating. A PONG while LANES_MAX_PONGS are
+// already waiting replaces the newest one's probe with its own and is freed. Returns LIST_FAIL
+// if the message's lanes are full; the caller still owns message then.
+int Lanes_push(Lanes* pLanes, Message* message);
+
+// Removes the next message to handle: control first, then the data lanes by weighted
+// deficit round robin. Returns NULL if every lane is empty.
+Message* Lanes_pop(Lanes* pLanes);
+
+// Messages across all lanes
+int Lanes_count(Lanes* pLanes);
+
+// Lock-free peek used while spinning for work; the answer must be rechecked under the lock
+bool Lanes_peek_nonempty(Lanes* pLanes);
+
+// Busy-polls the lanes without the lock for up to budgetNs (or until *pStop is set), so a
+// consumer can skip the condvar sleep/wakeup when work arrives quickly. Returns true if work
+// showed up; the caller still rechecks under the lock. A budget of 0 returns immediately.
+bool Lanes_spin(Lanes* pLanes, uint64_t budgetNs, const bool* pStop);
+
+// True if another data message can be pushed
+bool Lanes_has_room(Lanes* pLanes);
+
+// Empties every lane, handing the messages still queued to pItemFreeFn
+void Lanes_free(Lanes* pLanes, FREE_FN pItemFreeFn);
+
+#endif
@@ -466,3 +466,114 @@ void* List_search(List* pList, COMPARATOR_FN pComparator, void* pComparisonArg)
     pList -> boundsFlag = LIST_OOB_END;
     return NULL;
 }
+
+//Merges two sorted chains of nodes (linked through next only) into one and returns its head.
+//On ties the node from left goes first, which is what keeps List_sort and List_merge stable.
+static Node* mergeChains(Node* left, Node* right, COMPARATOR_FN pComparator) {
+    Node head;
+    Node* tail = &head;
+    while (left != NULL && right != NULL) {
+        if ((*pComparator)(left -> data, right -> data)) {
+            tail -> next = left;
+            left = left -> next;
+        } else {
+            tail -> next = right;
+            right = right -> next;
+        }
+        tail = tail -> next;
+    }
+    tail -> next = (left != NULL) ? left : right;
+    return head.next;
+}
+
+//Rebuilds the prev pointers and last of pList after its nodes were relinked through next
+static void relinkList(List* pList, Node* first) {
+    Node* prev = NULL;
+    for (Node* node = first; node != NULL; node = node -> next) {
+        node -> prev = prev;
+        prev = node;
+    }
+    pList -> first = first;
+    pList -> last = prev;
+}
+
+// Sorts pList in place. pComparator is called as (*pComparator)(pItem1, pItem2) and returns 
+// true if pItem1 belongs before pItem2 or the two are equal (pItem1 <= pItem2), false if 
+// pItem2 belongs first. 
+// The sort is stable (equal items keep their order), runs in O(n log n) (O(n) if pList is 
+// already sorted or reversed) and only relinks the existing nodes, so no nodes are needed and 
+// none are freed. The current item is unchanged.
+void List_sort(List* pList, COMPARATOR_FN pComparator) {
+    if (pList == NULL || pComparator == NULL || pList -> count < 2) {
+        return;
+    }
+    //The list is cut into runs that are already in order, and bins[i] holds the merge of 2^i
+    //of them (or nothing). Each run is merged in like a binary counter carrying, so the list is
+    //read once from front to back and the merges stay balanced. A higher bin always holds
+    //earlier nodes, so it goes in as the left side.
+    Node* bins[64] = { NULL };
+    int used = 0;
+    Node* node = pList -> first;
+    while (node != NULL) {
+        //take the longest run that is in order, or strictly backwards (reversed as it's taken,
+        //strictly so no equal items swap places)
+        Node* carry = node;
+        Node* tail = node;
+        node = node -> next;
+        if (node != NULL && !(*pComparator)(tail -> data, node -> data)) {
+            carry -> next = NULL;
+            while (node != NULL && !(*pComparator)(carry -> data, node -> data)) {
+                Node* next = node -> next;
+                node -> next = carry;
+                carry = node;
+                node = next;
+            }
+        } else {
+            while (node != NULL && (*pComparator)(tail -> data, node -> data)) {
+                tail = node;
+                node = node -> next;
+            }
+            tail -> next = NULL;
+        }
+        int i = 0;
+        while (bins[i] != NULL) {
+            carry = mergeChains(bins[i], carry, pComparator);
+            bins[i] = NULL;
+            i++;
+        }
+        bins[i] = carry;
+        if (i >= used) {
+            used = i + 1;
+        }
+    }
+    //fold the leftover runs together, later (lower) bins first
+    Node* sorted = NULL;
+    for (int i = 0; i < used; i++) {
+        if (bins[i] != NULL) {
+            sorted = mergeChains(bins[i], sorted, pComparator);
+        }
+    }
+    relinkList(pList, sorted);
+}
+
+// Merges the sorted pList2 into the sorted pList1 so that pList1 holds every item, still in 
+// order. pComparator works as in List_sort; when items are equal, those from pList1 come first. 
+// Runs in O(n + m). The current pointer is set to the current pointer of pList1. 
+// pList2 no longer exists after the operation; its head is available
+// for future operations.
+void List_merge(List* pList1, List* pList2, COMPARATOR_FN pComparator) {
+    if (pList1 == NULL || pList2 == NULL) {
+        return;
+    }
+    //without a comparator there is no order to keep, so just join them
+    if (pComparator == NULL) {
+        List_concat(pList1, pList2);
+        return;
+    }
+    if (pList2 -> count > 0) {
+        relinkList(pList1, mergeChains(pList1 -> first, pList2 -> first, pComparator));
+        pList1 -> count += pList2 -> count;
+    }
+    //Free the unused list head
+    pushFreeList(pList2);
+}
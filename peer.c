@@ -0,0 +1,127 @@
+#include <string.h>
+#include "peer.h"
+
+//absolute difference of two unsigned times
+static uint64_t absDiff(uint64_t a, uint64_t b) {
+    return a > b ? a - b : b - a;
+}
+
+//RTO = SRTT + 4 * RTTVAR clamped to sane bounds, caller holds the lock
+static uint64_t computeRto(Peer* pPeer) {
+    if (pPeer -> samples == 0) {
+        return PEER_INITIAL_RTO_NS;
+    }
+    uint64_t rto = pPeer -> srttNs + 4 * pPeer -> rttvarNs;
+    if (rto < PEER_MIN_RTO_NS) {
+        rto = PEER_MIN_RTO_NS;
+    }
+    if (rto > PEER_MAX_RTO_NS) {
+        rto = PEER_MAX_RTO_NS;
+    }
+    return rto;
+}
+
+void Peer_init(Peer* pPeer, uint64_t timeoutNs) {
+    memset(pPeer, 0, sizeof(*pPeer));
+    pthread_mutex_init(&pPeer -> lock, NULL);
+    pPeer -> timeoutNs = timeoutNs;
+    pPeer -> lastHeardNs = Proto_now_ns();
+}
+
+enum PeerChange Peer_heard(Peer* pPeer, uint64_t nowNs) {
+    enum PeerChange change = PEER_UNCHANGED;
+    pthread_mutex_lock(&pPeer -> lock);
+    pPeer -> lastHeardNs = nowNs;
+    if (!pPeer -> alive) {
+        pPeer -> alive = true;
+        change = PEER_CAME_UP;
+    }
+    pthread_mutex_unlock(&pPeer -> lock);
+    return change;
+}
+
+void Peer_next_probe(Peer* pPeer, uint64_t nowNs, ProtoProbe* pProbe) {
+    pthread_mutex_lock(&pPeer -> lock);
+    pProbe -> seq = pPeer -> nextSeq++;
+    pProbe -> sentNs = nowNs;
+    pPeer -> probesSent++;
+    pthread_mutex_unlock(&pPeer -> lock);
+}
+
+uint64_t Peer_on_pong(Peer* pPeer, const ProtoProbe* pProbe, uint64_t nowNs) {
+    //a probe from the future means it wasn't ours, ignore it
+    if (pProbe -> sentNs > nowNs) {
+        return 0;
+    }
+    uint64_t rtt = nowNs - pProbe -> sentNs;
+
+    pthread_mutex_lock(&pPeer -> lock);
+    if (pPeer -> samples == 0) {
+        //first measurement seeds the estimators (RFC 6298 section 2.2)
+        pPeer -> srttNs = rtt;
+        pPeer -> rttvarNs = rtt / 2;
+        pPeer -> minRttNs = rtt;
+    } else {
+        //RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+        pPeer -> rttvarNs = (3 * pPeer -> rttvarNs + absDiff(pPeer -> srttNs, rtt)) / 4;
+        pPeer -> srttNs = (7 * pPeer -> srttNs + rtt) / 8;
+        //J = J + (|D| - J) / 16, done in signed arithmetic since |D| may be below J
+        int64_t d = (int64_t)absDiff(rtt, pPeer -> lastRttNs);
+        int64_t j = (int64_t)pPeer -> jitterNs;
+        pPeer -> jitterNs = (uint64_t)(j + (d - j) / 16);
+        if (rtt < pPeer -> minRttNs) {
+            pPeer -> minRttNs = rtt;
+        }
+    }
+    pPeer -> lastRttNs = rtt;
+    pPeer -> samples++;
+    pthread_mutex_unlock(&pPeer -> lock);
+    return rtt;
+}
+
+enum PeerChange Peer_check(Peer* pPeer, uint64_t nowNs) {
+    enum PeerChange change = PEER_UNCHANGED;
+    pthread_mutex_lock(&pPeer -> lock);
+    if (pPeer -> alive && nowNs > pPeer -> lastHeardNs
+            && nowNs - pPeer -> lastHeardNs > pPeer -> timeoutNs) {
+        pPeer -> alive = false;
+        change = PEER_WENT_DOWN;
+    }
+    pthread_mutex_unlock(&pPeer -> lock);
+    return change;
+}
+
+uint64_t Peer_srtt_ns(Peer* pPeer) {
+    pthread_mutex_lock(&pPeer -> lock);
+    uint64_t srtt = pPeer -> srttNs;
+    pthread_mutex_unlock(&pPeer -> lock);
+    return srtt;
+}
+
+uint64_t Peer_rto_ns(Peer* pPeer) {
+    pthread_mutex_lock(&pPeer -> lock);
+    uint64_t rto = computeRto(pPeer);
+    pthread_mutex_unlock(&pPeer -> lock);
+    return rto;
+}
+
+bool Peer_alive(Peer* pPeer) {
+    pthread_mutex_lock(&pPeer -> lock);
+    bool alive = pPeer -> alive;
+    pthread_mutex_unlock(&pPeer -> lock);
+    return alive;
+}
+
+void Peer_snapshot(Peer* pPeer, uint64_t nowNs, PeerStats* pStats) {
+    pthread_mutex_lock(&pPeer -> lock);
+    pStats -> srttNs = pPeer -> srttNs;
+    pStats -> rttvarNs = pPeer -> rttvarNs;
+    pStats -> jitterNs = pPeer -> jitterNs;
+    pStats -> minRttNs = pPeer -> minRttNs;
+    pStats -> rtoNs = computeRto(pPeer);
+    pStats -> sinceHeardNs = nowNs > pPeer -> lastHeardNs ? nowNs - pPeer -> lastHeardNs : 0;
+    pStats -> samples = pPeer -> samples;
+    pStats -> probesSent = pPeer -> probesSent;
+    pStats -> alive = pPeer -> alive;
+    pthread_mutex_unlock(&pPeer -> lock);
+}
@@ -0,0 +1,79 @@
+// Peer liveness and round trip time tracking
+//
+// sendMsgThread probes the peer with PING records every heartbeat interval and getMsgThread
+// feeds the echoed PONG back in here. RTT is smoothed the same way TCP does it (RFC 6298)
+// and jitter is the RFC 3550 interarrival estimate applied to consecutive RTT samples.
+// Any datagram from the peer (its address and s-talk port, see handleDatagram) counts as a sign
+// of life.
+
+#ifndef _PEER_H_
+#define _PEER_H_
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "proto.h"
+
+// Retransmit timeout bounds, same spirit as RFC 6298 (with a lower floor for a LAN chat)
+#define PEER_MIN_RTO_NS 50000000ull      // 50ms
+#define PEER_MAX_RTO_NS 60000000000ull   // 60s
+#define PEER_INITIAL_RTO_NS 1000000000ull // 1s until the first sample arrives
+
+enum PeerChange {
+    PEER_UNCHANGED,
+    PEER_CAME_UP,
+    PEER_WENT_DOWN
+};
+
+typedef struct Peer_s Peer;
+struct Peer_s {
+    pthread_mutex_t lock;
+    uint64_t timeoutNs;   // silence longer than this marks the peer dead
+    uint64_t lastHeardNs; // monotonic time of the last datagram from the peer
+    uint64_t srttNs;      // smoothed round trip time
+    uint64_t rttvarNs;    // round trip time variation
+    uint64_t jitterNs;    // RFC 3550 style jitter between consecutive samples
+    uint64_t lastRttNs;
+    uint64_t minRttNs;
+    uint32_t nextSeq;
+    uint32_t samples;
+    uint32_t probesSent;
+    bool alive;
+};
+
+// A consistent copy of the estimates, for callers that don't want to hold the lock
+typedef struct PeerStats_s PeerStats;
+struct PeerStats_s {
+    uint64_t srttNs;
+    uint64_t rttvarNs;
+    uint64_t jitterNs;
+    uint64_t minRttNs;
+    uint64_t rtoNs;
+    uint64_t sinceHeardNs;
+    uint32_t samples;
+    uint32_t probesSent;
+    bool alive;
+};
+
+// Resets pPeer. The peer starts out as not alive until something is heard from it.
+void Peer_init(Peer* pPeer, uint64_t timeoutNs);
+
+// Records that a datagram arrived from the peer at nowNs.
+// Returns PEER_CAME_UP if the peer was previously considered dead.
+enum PeerChange Peer_heard(Peer* pPeer, uint64_t nowNs);
+
+// Fills in the next probe to send and counts it as sent.
+void Peer_next_probe(Peer* pPeer, uint64_t nowNs, ProtoProbe* pProbe);
+
+// Feeds an echoed probe back in. Returns the measured RTT in nanoseconds.
+uint64_t Peer_on_pong(Peer* pPeer, const ProtoProbe* pProbe, uint64_t nowNs);
+
+// Checks for a timeout. Returns PEER_WENT_DOWN exactly once when the peer goes silent.
+enum PeerChange Peer_check(Peer* pPeer, uint64_t nowNs);
+
+// Estimates for the rest of the system (retransmit timers, batching decisions, stats)
+uint64_t Peer_srtt_ns(Peer* pPeer);
+uint64_t Peer_rto_ns(Peer* pPeer);
+bool Peer_alive(Peer* pPeer);
+void Peer_snapshot(Peer* pPeer, uint64_t nowNs, PeerStats* pStats);
+
+#endif
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "proto.h"
+
+//Big endian helpers for the 64 bit fields (htonl/ntohl only cover 32 bits)
+static void put64(char *out, uint64_t v) {
+    uint32_t hi = htonl((uint32_t)(v >> 32));
+    uint32_t lo = htonl((uint32_t)v);
+    memcpy(out, &hi, 4);
+    memcpy(out + 4, &lo, 4);
+}
+
+static uint64_t get64(const char *in) {
+    uint32_t hi, lo;
+    memcpy(&hi, in, 4);
+    memcpy(&lo, in + 4, 4);
+    return ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+}
+
+size_t Proto_begin(char *buf) {
+    buf[0] = (char)PROTO_MAGIC;
+    return 1;
+}
+
+size_t Proto_put(char *buf, size_t off, size_t cap, uint8_t type, uint8_t flags,
+                 const void *payload, uint16_t len) {
+    //refuse records that would run past the end of the datagram
+    if (off + PROTO_RECORD_HEADER + len > cap) {
+        return 0;
+    }
+    uint16_t netLen = htons(len);
+    buf[off] = (char)type;
+    buf[off + 1] = (char)flags;
+    memcpy(buf + off + 2, &netLen, 2);
+    if (len > 0) {
+        memcpy(buf + off + PROTO_RECORD_HEADER, payload, len);
+    }
+    return off + PROTO_RECORD_HEADER + len;
+}
+
+bool Proto_next(const char *buf, size_t len, size_t *pOff, ProtoRecord *pRecord) {
+    //legacy datagram without framing: the whole thing is one text message
+    if (len == 0 || (uint8_t)buf[0] != PROTO_MAGIC) {
+        if (*pOff != 0 || len == 0) {
+            return false;
+        }
+        pRecord -> type = (len == 2 && memcmp(buf, "!\n", 2) == 0) ? PROTO_BYE : PROTO_TEXT;
+        if (len == sizeof(PROTO_HELLO_TEXT) - 1 && memcmp(buf, PROTO_HELLO_TEXT, len) == 0) {
+            pRecord -> type = PROTO_HELLO;
+        }
+        pRecord -> flags = 0;
+        pRecord -> len = (uint16_t)len;
+        pRecord -> payload = buf;
+        *pOff = len;
+        return true;
+    }
+    //skip the magic byte on the first call
+    if (*pOff == 0) {
+        *pOff = 1;
+    }
+    if (*pOff + PROTO_RECORD_HEADER > len) {
+        return false;
+    }
+    uint16_t netLen;
+    memcpy(&netLen, buf + *pOff + 2, 2);
+    uint16_t recordLen = ntohs(netLen);
+    if (*pOff + PROTO_RECORD_HEADER + recordLen > len) {
+        return false;
+    }
+    pRecord -> type = (uint8_t)buf[*pOff];
+    pRecord -> flags = (uint8_t)buf[*pOff + 1];
+    pRecord -> len = recordLen;
+    pRecord -> payload = buf + *pOff + PROTO_RECORD_HEADER;
+    *pOff += PROTO_RECORD_HEADER + recordLen;
+    return true;
+}
+
+size_t Proto_put_legacy(char *buf, size_t cap, uint8_t type, const void *payload, uint16_t len) {
+    if (type == PROTO_BYE) {
+        payload = "!\n";
+        len = 2;
+    } else if (type == PROTO_HELLO) {
+        payload = PROTO_HELLO_TEXT;
+        len = sizeof(PROTO_HELLO_TEXT) - 1;
+    } else if (type != PROTO_TEXT) {
+        return 0;
+    }
+    //a raw line starting with the magic byte would be taken for a framed datagram
+    if (len == 0 || len > cap || (uint8_t)((const char *)payload)[0] == PROTO_MAGIC) {
+        return 0;
+    }
+    memcpy(buf, payload, len);
+    return len;
+}
+
+size_t Proto_put_traced(char *buf, size_t off, size_t cap, uint8_t type, const ProtoTrace *pTrace,
+                        const void *payload, uint16_t len) {
+    if (off + PROTO_RECORD_HEADER + PROTO_TRACE_SIZE + len > cap || len > UINT16_MAX - PROTO_TRACE_SIZE) {
+        return 0;
+    }
+    //write the header with an empty payload, then the trace header and the payload behind it
+    off = Proto_put(buf, off, cap, type, PROTO_F_TRACE, NULL, 0);
+    uint16_t netLen = htons((uint16_t)(PROTO_TRACE_SIZE + len));
+    memcpy(buf + off - 2, &netLen, 2);
+    uint32_t netId = htonl(pTrace -> id);
+    memcpy(buf + off, &netId, 4);
+    put64(buf + off + 4, pTrace -> typedNs);
+    put64(buf + off + 12, pTrace -> sentNs);
+    if (len > 0) {
+        memcpy(buf + off + PROTO_TRACE_SIZE, payload, len);
+    }
+    return off + PROTO_TRACE_SIZE + len;
+}
+
+bool Proto_get_trace(ProtoRecord *pRecord, ProtoTrace *pTrace) {
+    if (!(pRecord -> flags & PROTO_F_TRACE) || pRecord -> len < PROTO_TRACE_SIZE) {
+        return false;
+    }
+    uint32_t netId;
+    memcpy(&netId, pRecord -> payload, 4);
+    pTrace -> id = ntohl(netId);
+    pTrace -> typedNs = get64(pRecord -> payload + 4);
+    pTrace -> sentNs = get64(pRecord -> payload + 12);
+    pRecord -> payload += PROTO_TRACE_SIZE;
+    pRecord -> len -= PROTO_TRACE_SIZE;
+    return true;
+}
+
+size_t Proto_put_sequenced(char *buf, size_t off, size_t cap, const ProtoRecord *pRecord, uint64_t seq) {
+    if (off + PROTO_RECORD_HEADER + PROTO_SEQ_SIZE + pRecord -> len > cap
+            || pRecord -> len > UINT16_MAX - PROTO_SEQ_SIZE) {
+        return 0;
+    }
+    off = Proto_put(buf, off, cap, pRecord -> type, pRecord -> flags | PROTO_F_SEQ, NULL, 0);
+    uint16_t netLen = htons((uint16_t)(PROTO_SEQ_SIZE + pRecord -> len));
+    memcpy(buf + off - 2, &netLen, 2);
+    put64(buf + off, seq);
+    if (pRecord -> len > 0) {
+        memcpy(buf + off + PROTO_SEQ_SIZE, pRecord -> payload, pRecord -> len);
+    }
+    return off + PROTO_SEQ_SIZE + pRecord -> len;
+}
+
+bool Proto_get_seq(ProtoRecord *pRecord, uint64_t *pSeq) {
+    if (!(pRecord -> flags & PROTO_F_SEQ) || pRecord -> len < PROTO_SEQ_SIZE) {
+        return false;
+    }
+    *pSeq = get64(pRecord -> payload);
+    pRecord -> payload += PROTO_SEQ_SIZE;
+    pRecord -> len -= PROTO_SEQ_SIZE;
+    pRecord -> flags &= ~PROTO_F_SEQ;
+    return true;
+}
+
+void Proto_put_relay(char *out, const ProtoRelay *pRelay) {
+    uint32_t netEpoch = htonl(pRelay -> epoch);
+    memcpy(out, &netEpoch, 4);
+    put64(out + 4, pRelay -> base);
+}
+
+bool Proto_get_relay(const ProtoRecord *pRecord, ProtoRelay *pRelay) {
+    if (pRecord -> len < PROTO_RELAY_SIZE) {
+        return false;
+    }
+    uint32_t netEpoch;
+    memcpy(&netEpoch, pRecord -> payload, 4);
+    pRelay -> epoch = ntohl(netEpoch);
+    pRelay -> base = get64(pRecord -> payload + 4);
+    return true;
+}
+
+void Proto_put_probe(char *out, const ProtoProbe *pProbe) {
+    uint32_t netSeq = htonl(pProbe -> seq);
+    memcpy(out, &netSeq, 4);
+    put64(out + 4, pProbe -> sentNs);
+}
+
+bool Proto_get_probe(const ProtoRecord *pRecord, ProtoProbe *pProbe) {
+    if (pRecord -> len < PROTO_PROBE_SIZE) {
+        return false;
+    }
+    uint32_t netSeq;
+    memcpy(&netSeq, pRecord -> payload, 4);
+    pProbe -> seq = ntohl(netSeq);
+    pProbe -> sentNs = get64(pRecord -> payload + 4);
+    return true;
+}
+
+Message* Message_create(uint8_t type, const void *data, uint16_t len) {
+    //one allocation for the header and the payload, plus room for the terminating NUL
+    Message* message = malloc(sizeof(Message) + len + 1);
+    if (message == NULL) {
+        return NULL;
+    }
+    message -> type = type;
+    message -> len = len;
+    message -> bulk = false;
+    message -> queuedNs = 0;
+    message -> traceId = 0;
+    message -> typedNs = 0;
+    message -> sentNs = 0;
+    if (len > 0) {
+        memcpy(message -> data, data, len);
+    }
+    message -> data[len] = '\0';
+    return message;
+}
+
+uint64_t Proto_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t Proto_realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
@@ -0,0 +1,166 @@
+// Wire format for s-talk datagrams
+//
+// A framed datagram starts with PROTO_MAGIC followed by one or more records. Every record
+// has a small fixed header (type, flags, payload length) and then its payload. Datagrams that
+// do not start with PROTO_MAGIC are treated as a single legacy text message, so an s-talk
+// that only sends raw lines can still talk to us.
+//
+// Going the other way, an original s-talk would print a framed datagram as garbage, so nothing
+// framed goes out until the peer has shown it understands framing. Until then lines are sent
+// raw (Proto_put_legacy) and we announce ourselves with PROTO_HELLO_TEXT, a plain line an
+// original s-talk just shows and a newer one takes as the cue to answer framed.
+
+#ifndef _PROTO_H_
+#define _PROTO_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ilist.h"
+
+#define PROTO_MAGIC 0xA5
+
+// Largest datagram we ever send (fits a 1500 byte ethernet MTU after IPv4 + UDP headers)
+#define PROTO_MAX_DATAGRAM 1472
+
+// Size of the fixed record header: type (1), flags (1), payload length (2, network order)
+#define PROTO_RECORD_HEADER 4
+
+// Longest chat line a single record can carry (keyInputThread reads at most 1023 chars)
+#define PROTO_MAX_TEXT 1024
+
+enum ProtoType {
+    PROTO_TEXT = 1,  // chat line typed by the user
+    PROTO_PING = 2,  // heartbeat probe, payload is a ProtoProbe
+    PROTO_PONG = 3,  // reply to a probe, echoes the ProtoProbe payload untouched
+    PROTO_BYE = 4,   // the peer is exiting (the old "!\n" signal)
+    PROTO_NOTICE = 5, // local only: status line for screenOutputThread, never sent
+    PROTO_HELLO = 6,  // the peer speaks framing, only ever sent raw as PROTO_HELLO_TEXT
+    PROTO_RELAY = 7   // starts every datagram s-talk-relay delivers, payload is a ProtoRelay
+};
+
+// The raw line that announces framing support (decoded by Proto_next as a PROTO_HELLO record)
+#define PROTO_HELLO_TEXT "[s-talk: this peer also speaks the framed protocol]\n"
+
+
+// Record flags
+#define PROTO_F_TRACE 0x01 // payload starts with a ProtoTrace header (see -T)
+#define PROTO_F_SEQ 0x02   // payload starts with the relay's sequence number, ahead of any trace header
+
+// Size of the sequence number s-talk-relay puts in front of the lines it delivers
+#define PROTO_SEQ_SIZE 8
+
+// Payload of PING and PONG records. The timestamp is the prober's own monotonic clock,
+// so only the side that sent the PING ever interprets it.
+typedef struct ProtoProbe_s ProtoProbe;
+struct ProtoProbe_s {
+    uint32_t seq;
+    uint64_t sentNs;
+};
+#define PROTO_PROBE_SIZE 12
+
+// Payload of RELAY records: which spool the numbered lines come from (a new epoch means the
+// numbering started over) and the first line the relay hasn't had confirmed yet. Everything
+// below base has been delivered.
+typedef struct ProtoRelay_s ProtoRelay;
+struct ProtoRelay_s {
+    uint32_t epoch;
+    uint64_t base;
+};
+#define PROTO_RELAY_SIZE 12
+
+// Optional per-message tracing header. typedNs is CLOCK_REALTIME on the sender when the line
+// was read from the keyboard, sentNs when the datagram went out; the gap between them is the
+// sender's queueing and coalescing. The receiver's view of network time is only as good as
+// the clock sync between the two machines (exact when both ends share a host).
+typedef struct ProtoTrace_s ProtoTrace;
+struct ProtoTrace_s {
+    uint32_t id;
+    uint64_t typedNs;
+    uint64_t sentNs;
+};
+#define PROTO_TRACE_SIZE 20
+
+// One decoded record. payload points into the datagram buffer that was parsed.
+typedef struct ProtoRecord_s ProtoRecord;
+struct ProtoRecord_s {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t len;
+    const char *payload;
+};
+
+// Writes the magic byte that starts every framed datagram. Returns the number of bytes written.
+size_t Proto_begin(char *buf);
+
+// Appends a record to buf at offset off. Returns the new offset, or 0 if the record
+// does not fit into cap bytes.
+size_t Proto_put(char *buf, size_t off, size_t cap, uint8_t type, uint8_t flags,
+                 const void *payload, uint16_t len);
+
+// Walks the records of a received datagram. *pOff must start at 0; each call decodes the
+// next record into pRecord and advances *pOff. Returns false when there are no more records
+// or the rest of the datagram is malformed.
+bool Proto_next(const char *buf, size_t len, size_t *pOff, ProtoRecord *pRecord);
+
+// Writes a record the way an original s-talk expects it: a TEXT record is its raw line, BYE is
+// "!\n" and HELLO is PROTO_HELLO_TEXT, each as a datagram of its own. Returns the datagram's
+// length, 0 for records that have no raw form (PING/PONG) or don't fit.
+size_t Proto_put_legacy(char *buf, size_t cap, uint8_t type, const void *payload, uint16_t len);
+
+// Like Proto_put, but flags the record with PROTO_F_TRACE and puts the trace header in front
+// of the payload.
+size_t Proto_put_traced(char *buf, size_t off, size_t cap, uint8_t type, const ProtoTrace *pTrace,
+                        const void *payload, uint16_t len);
+
+// If the record carries a trace header, decodes it into pTrace, strips it from pRecord's payload
+// and returns true. Returns false (leaving pRecord alone) for untraced or malformed records.
+bool Proto_get_trace(ProtoRecord *pRecord, ProtoTrace *pTrace);
+
+// Like Proto_put for pRecord, but flags it with PROTO_F_SEQ and puts seq in front of its payload
+// (relay delivery numbers every line so s-talk can drop the ones it gets twice).
+size_t Proto_put_sequenced(char *buf, size_t off, size_t cap, const ProtoRecord *pRecord, uint64_t seq);
+
+// If the record carries a sequence number, decodes it into *pSeq, strips it from pRecord's
+// payload and returns true. Call it before Proto_get_trace.
+bool Proto_get_seq(ProtoRecord *pRecord, uint64_t *pSeq);
+
+// Encodes/decodes a relay payload (PROTO_RELAY_SIZE bytes, network order)
+void Proto_put_relay(char *out, const ProtoRelay *pRelay);
+bool Proto_get_relay(const ProtoRecord *pRecord, ProtoRelay *pRelay);
+
+// Encodes/decodes a probe payload (PROTO_PROBE_SIZE bytes, network order)
+void Proto_put_probe(char *out, const ProtoProbe *pProbe);
+bool Proto_get_probe(const ProtoRecord *pRecord, ProtoProbe *pProbe);
+
+// A message waiting in sendList or receiveList. The payload is stored inline right after the
+// struct (one allocation per message) and is always NUL terminated so text can go to fputs.
+// Messages are queued through their embedded link, so queueing one never allocates.
+typedef struct Message_s Message;
+struct Message_s {
+    IListLink link;
+    uint8_t type;
+    uint16_t len;
+    bool bulk;         // text from a paste, queued in the bulk lane (see lanes.h)
+    uint64_t queuedNs; // when the message entered its list (Proto_now_ns)
+
+    // tracing (traceId 0 means untraced)
+    uint32_t traceId;
+    uint64_t typedNs;  // CLOCK_REALTIME when the line was typed (set by keyInputThread, or from the trace header)
+    uint64_t sentNs;   // sender's CLOCK_REALTIME from the trace header
+    char data[];
+};
+
+// MessageList_push/_pop/_first/... for ILists of messages (see ilist.h)
+ILIST_DEFINE(MessageList, Message, link)
+
+// Allocates a message holding a copy of len bytes of data. Returns NULL on failure.
+// Messages are released with free().
+Message* Message_create(uint8_t type, const void *data, uint16_t len);
+
+// Current CLOCK_MONOTONIC time in nanoseconds
+uint64_t Proto_now_ns(void);
+
+// Current CLOCK_REALTIME time in nanoseconds (comparable across machines with synced clocks)
+uint64_t Proto_realtime_ns(void);
+
+#endif
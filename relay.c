@@ -0,0 +1,459 @@
+// s-talk-relay: store-and-forward relay between two s-talk instances
+//
+// usage: s-talk-relay [-d spool dir] [-i heartbeat ms] [-t timeout ms]
+//                     [relay port A] [host A] [port A] [relay port B] [host B] [port B]
+//
+// Each side points its s-talk at its own relay port (s-talk [port A] [relay host] [relay port A]).
+// Chat lines from one side are appended to a disk-backed spool for the other side (spool dir/A
+// and spool dir/B, default ./s-talk-spool) and delivered from there, in order, whenever that
+// side's s-talk is up. Nothing typed while the peer is offline is lost, and a restarted relay
+// carries on where it left off. Goodbyes are not forwarded: one side leaving doesn't end the
+// other side's session.
+//
+// Durability: everything one burst of datagrams brings in goes to disk with a single Spool_sync
+// (group commit) and the relay answers the sender's PINGs only after that, so a PONG from the
+// relay means every earlier line is on disk.
+//
+// Delivery: lines go out packed into datagrams, up to RELAY_WINDOW datagrams at a time, each one
+// ending in a PING. Every line is spooled with its sequence number in the outbox (PROTO_F_SEQ) and
+// every datagram starts with a RELAY record naming the spool's epoch and the first unconfirmed
+// line. s-talk shows a line only if it is the next one it expects, counts the ones it has seen
+// as duplicates, and answers a datagram's PING only when none of its lines was skipped for coming
+// early, so once every PING of the window has come back the whole window has been shown and it is
+// acknowledged in the spool. If a PONG is missing after the peer's RTO (doubled on every miss),
+// the window is sent again from the first unconfirmed line: delivery is at least once and in
+// order, and s-talk shows each line once (a restarted s-talk may see unconfirmed ones again).
+// A wiped spool starts a new epoch, and s-talk starts expecting the numbering over with it.
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "peer.h"
+#include "proto.h"
+#include "spool.h"
+
+//Datagrams sent per delivery round before waiting for their PONGs (at most 64, one bit each)
+#define RELAY_WINDOW 32
+
+//Datagrams taken off the socket before the group commit
+#define RELAY_BATCH 256
+
+//Room a delivered datagram keeps free for its PING
+#define RELAY_PING_SIZE (PROTO_RECORD_HEADER + PROTO_PROBE_SIZE)
+
+//Same receive buffer as s-talk, so a burst from the sender waits in the kernel
+#define RELAY_SOCKET_BUFFER (1 << 20)
+
+//Longest retransmit backoff, as a shift of the RTO
+#define RELAY_MAX_BACKOFF 6
+
+typedef struct Side_s Side;
+struct Side_s {
+    const char* name;
+    int s;                 // bound to this side's relay port: its s-talk sends here
+    struct addrinfo* dest; // this side's s-talk
+    Peer peer;             // this side's liveness, from the relay's probes
+    Spool outbox;          // lines waiting to be delivered to this side
+    Side* other;
+
+    //delivery window: PONGs seen for the probes windowFirst .. windowFirst + windowCount - 1
+    pthread_mutex_t ackMutex;
+    pthread_cond_t ackFlag;
+    uint32_t windowFirst;
+    int windowCount;
+    uint64_t ponged;
+
+    uint64_t spooled;   // lines appended to this side's outbox
+    uint64_t delivered; // lines confirmed by this side
+    uint64_t resent;    // lines sent again after a missing PONG
+    pthread_t receiver;
+    pthread_t deliverer;
+};
+
+static Side sides[2];
+static volatile bool stopping = false;
+static uint64_t heartbeatIntervalNs = 1000000000ull;
+static uint64_t peerTimeoutNs = 5000000000ull;
+
+//Same conversion s-talk uses for its timed waits
+static struct timespec realtimeDeadline(uint64_t deadlineNs) {
+    uint64_t now = Proto_now_ns();
+    uint64_t wait = deadlineNs > now ? deadlineNs - now : 0;
+    uint64_t at = Proto_realtime_ns() + wait;
+    struct timespec ts = { (time_t)(at / 1000000000ull), (long)(at % 1000000000ull) };
+    return ts;
+}
+
+//Bits of Side.ponged that are set once all count PONGs of a window are back
+static uint64_t windowMask(int count) {
+    return count >= 64 ? ~0ull : (1ull << count) - 1;
+}
+
+static void sendTo(Side* side, const char* datagram, size_t len) {
+    if (sendto(side -> s, datagram, len, 0, side -> dest -> ai_addr, side -> dest -> ai_addrlen) < 0
+            && errno != ECONNREFUSED) {
+        perror("Failed to send");
+    }
+}
+
+//Puts a PING for the next probe at the end of datagram and returns the new length. The caller
+//leaves RELAY_PING_SIZE bytes free for it.
+static size_t putProbe(Side* side, char* datagram, size_t len, uint64_t now, uint32_t* pSeq) {
+    ProtoProbe probe;
+    char payload[PROTO_PROBE_SIZE];
+    Peer_next_probe(&side -> peer, now, &probe);
+    Proto_put_probe(payload, &probe);
+    *pSeq = probe.seq;
+    return Proto_put(datagram, len, PROTO_MAX_DATAGRAM, PROTO_PING, 0, payload, sizeof(payload));
+}
+
+//Starts a datagram of the side's delivery with the RELAY record that tells s-talk which lines
+//are already confirmed and returns its length
+static size_t putRelay(Side* side, char* datagram) {
+    ProtoRelay relay = { side -> outbox.epoch, side -> outbox.acked.seq };
+    char payload[PROTO_RELAY_SIZE];
+    Proto_put_relay(payload, &relay);
+    return Proto_put(datagram, Proto_begin(datagram), PROTO_MAX_DATAGRAM, PROTO_RELAY, 0, payload, sizeof(payload));
+}
+
+//Takes one side's datagrams off its socket, spools their lines for the other side and answers
+//its PINGs once those lines are durable
+static void* receiveThread(void* arg) {
+    Side* side = arg;
+    char buffer[PROTO_MAX_DATAGRAM];
+    char pongs[PROTO_MAX_DATAGRAM];
+
+    while (!stopping) {
+        //all PONGs of a burst travel back together in one datagram
+        size_t pongLen = Proto_begin(pongs);
+        size_t firstPong = pongLen;
+        bool appended = false;
+        for (int i = 0; i < RELAY_BATCH; i++) {
+            //block for the first datagram, then drain whatever else is already queued
+            ssize_t len = recv(side -> s, buffer, sizeof(buffer), i == 0 ? 0 : MSG_DONTWAIT);
+            if (len <= 0) {
+                break;
+            }
+            uint64_t now = Proto_now_ns();
+            if (Peer_heard(&side -> peer, now) == PEER_CAME_UP) {
+                printf("%s is up, %llu lines waiting for it\n", side -> name,
+                       (unsigned long long)Spool_pending(&side -> outbox));
+                fflush(stdout);
+                //wake the deliverer, it may be waiting out a heartbeat interval
+                pthread_mutex_lock(&side -> ackMutex);
+                pthread_cond_signal(&side -> ackFlag);
+                pthread_mutex_unlock(&side -> ackMutex);
+            }
+
+            size_t off = 0;
+            ProtoRecord record;
+            while (Proto_next(buffer, (size_t)len, &off, &record)) {
+                if (record.type == PROTO_TEXT) {
+                    //spooled in wire form, numbered and with any trace header, ready to be copied
+                    //into a datagram (this thread is the only one appending to that outbox)
+                    char wire[PROTO_MAX_DATAGRAM];
+                    uint64_t seq;
+                    Proto_get_seq(&record, &seq); //a line relayed twice keeps only our number
+                    size_t wireLen = Proto_put_sequenced(wire, 0, sizeof(wire), &record,
+                                                         side -> other -> outbox.nextSeq);
+                    if (wireLen > 0 && Spool_append(&side -> other -> outbox, wire, (uint32_t)wireLen) == 0) {
+                        side -> other -> spooled++;
+                        appended = true;
+                    } else if (wireLen > 0) {
+                        perror("Failed to spool a line");
+                    }
+                } else if (record.type == PROTO_PING) {
+                    size_t next = Proto_put(pongs, pongLen, sizeof(pongs), PROTO_PONG, 0, record.payload, record.len);
+                    pongLen = next > 0 ? next : pongLen;
+                } else if (record.type == PROTO_PONG) {
+                    ProtoProbe probe;
+                    if (!Proto_get_probe(&record, &probe)) {
+                        continue;
+                    }
+                    Peer_on_pong(&side -> peer, &probe, now);
+                    pthread_mutex_lock(&side -> ackMutex);
+                    uint32_t slot = probe.seq - side -> windowFirst;
+                    if (slot < (uint32_t)side -> windowCount) {
+                        side -> ponged |= 1ull << slot;
+                        if (side -> ponged == windowMask(side -> windowCount)) {
+                            pthread_cond_signal(&side -> ackFlag);
+                        }
+                    }
+                    pthread_mutex_unlock(&side -> ackMutex);
+                }
+            }
+        }
+
+        //group commit: one fdatasync for the whole burst, then the PONGs that vouch for it
+        if (appended && Spool_sync(&side -> other -> outbox) < 0) {
+            perror("Failed to sync the spool");
+            exit(EXIT_FAILURE);
+        }
+        if (pongLen > firstPong) {
+            sendTo(side, pongs, pongLen);
+        }
+    }
+    return NULL;
+}
+
+//Waits on the side's ack condition until deadlineNs, the window is confirmed or the relay stops.
+//Returns true if the window was confirmed.
+static bool waitForWindow(Side* side, uint64_t deadlineNs) {
+    struct timespec deadline = realtimeDeadline(deadlineNs);
+    pthread_mutex_lock(&side -> ackMutex);
+    uint64_t all = windowMask(side -> windowCount);
+    while (side -> ponged != all && !stopping) {
+        if (pthread_cond_timedwait(&side -> ackFlag, &side -> ackMutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    bool confirmed = side -> ponged == all;
+    side -> windowCount = 0;
+    pthread_mutex_unlock(&side -> ackMutex);
+    return confirmed;
+}
+
+//Delivers one side's outbox in windows while the side is up, and probes it either way
+static void* deliverThread(void* arg) {
+    Side* side = arg;
+    char (*datagrams)[PROTO_MAX_DATAGRAM] = malloc(sizeof(*datagrams) * RELAY_WINDOW);
+    size_t lens[RELAY_WINDOW];
+    char held[PROTO_MAX_DATAGRAM];
+    size_t heldLen = 0;
+    SpoolPos heldAt; // where held was read from, it isn't confirmed with the window it didn't fit
+    uint64_t nextProbeNs = 0;
+    int backoff = 0;
+
+    while (!stopping) {
+        uint64_t now = Proto_now_ns();
+        if (now >= nextProbeNs) {
+            char probe[64];
+            uint32_t seq;
+            size_t len = putProbe(side, probe, Proto_begin(probe), now, &seq);
+            sendTo(side, probe, len);
+            nextProbeNs = now + heartbeatIntervalNs;
+            if (Peer_check(&side -> peer, now) == PEER_WENT_DOWN) {
+                printf("%s is not responding, holding its lines\n", side -> name);
+                fflush(stdout);
+            }
+        }
+
+        if (!Peer_alive(&side -> peer)) {
+            //wait for the next probe, or for the receiver to hear from the side again
+            struct timespec deadline = realtimeDeadline(nextProbeNs);
+            pthread_mutex_lock(&side -> ackMutex);
+            if (!stopping) {
+                pthread_cond_timedwait(&side -> ackFlag, &side -> ackMutex, &deadline);
+            }
+            pthread_mutex_unlock(&side -> ackMutex);
+            continue;
+        }
+
+        //pack as many lines as fit into the window, keeping the one that doesn't for next time
+        int count = 0;
+        int lines = 0;
+        while (1) {
+            if (heldLen == 0) {
+                heldAt = side -> outbox.read;
+                ssize_t n = Spool_read(&side -> outbox, held, sizeof(held));
+                if (n < 0) {
+                    perror("Failed to read the spool");
+                    exit(EXIT_FAILURE);
+                }
+                if (n == 0) {
+                    break;
+                }
+                heldLen = (size_t)n;
+            }
+            if (count == 0 || lens[count - 1] + heldLen + RELAY_PING_SIZE > PROTO_MAX_DATAGRAM) {
+                if (count == RELAY_WINDOW) {
+                    break;
+                }
+                lens[count] = putRelay(side, datagrams[count]);
+                count++;
+            }
+            memcpy(datagrams[count - 1] + lens[count - 1], held, heldLen);
+            lens[count - 1] += heldLen;
+            heldLen = 0;
+            lines++;
+        }
+
+        if (count == 0) {
+            struct timespec deadline = realtimeDeadline(nextProbeNs);
+            Spool_wait(&side -> outbox, &deadline);
+            continue;
+        }
+
+        //arm the window before sending so no PONG can slip past it
+        now = Proto_now_ns();
+        pthread_mutex_lock(&side -> ackMutex);
+        side -> ponged = 0;
+        side -> windowCount = count;
+        for (int i = 0; i < count; i++) {
+            uint32_t seq;
+            lens[i] = putProbe(side, datagrams[i], lens[i], now, &seq);
+            if (i == 0) {
+                side -> windowFirst = seq;
+            }
+        }
+        pthread_mutex_unlock(&side -> ackMutex);
+
+        for (int i = 0; i < count; i++) {
+            sendTo(side, datagrams[i], lens[i]);
+        }
+
+        uint64_t timeoutNs = Peer_rto_ns(&side -> peer) << backoff;
+        if (waitForWindow(side, now + timeoutNs)) {
+            if (Spool_ack_to(&side -> outbox, heldLen > 0 ? &heldAt : &side -> outbox.read) < 0) {
+                perror("Failed to record delivery");
+            }
+            side -> delivered += lines;
+            backoff = 0;
+        } else if (!stopping) {
+            Spool_rewind(&side -> outbox);
+            heldLen = 0;
+            side -> resent += lines;
+            backoff = backoff < RELAY_MAX_BACKOFF ? backoff + 1 : backoff;
+            Peer_check(&side -> peer, Proto_now_ns());
+        }
+    }
+    free(datagrams);
+    return NULL;
+}
+
+static int openSide(Side* side, const char* name, const char* spoolDir, const char* relayPort,
+                    const char* host, const char* port) {
+    side -> name = name;
+    pthread_mutex_init(&side -> ackMutex, NULL);
+    pthread_cond_init(&side -> ackFlag, NULL);
+    Peer_init(&side -> peer, peerTimeoutNs);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, port, &hints, &side -> dest) != 0) {
+        fprintf(stderr, "Failed to resolve %s\n", host);
+        return -1;
+    }
+
+    side -> s = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(relayPort));
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (side -> s < 0 || bind(side -> s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Failed to bind the relay port");
+        return -1;
+    }
+    int rcvbuf = RELAY_SOCKET_BUFFER;
+    setsockopt(side -> s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", spoolDir, name);
+    uint64_t start = Proto_now_ns();
+    if (Spool_open(&side -> outbox, path) < 0) {
+        perror("Failed to open the spool");
+        return -1;
+    }
+    printf("%s: %llu lines waiting in %s (recovered in %.1f ms", name,
+           (unsigned long long)Spool_pending(&side -> outbox), path, (Proto_now_ns() - start) / 1e6);
+    if (side -> outbox.recoveredBytes > 0) {
+        printf(", dropped a %llu byte torn tail", (unsigned long long)side -> outbox.recoveredBytes);
+    }
+    printf(")\n");
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char* spoolDir = "s-talk-spool";
+    int opt;
+    while ((opt = getopt(argc, argv, "d:i:t:")) != -1) {
+        switch (opt) {
+            case 'd':
+                spoolDir = optarg;
+                break;
+            case 'i':
+                heartbeatIntervalNs = strtoull(optarg, NULL, 10) * 1000000ull;
+                break;
+            case 't':
+                peerTimeoutNs = strtoull(optarg, NULL, 10) * 1000000ull;
+                break;
+            default:
+                argc = 0;
+                break;
+        }
+    }
+    if (argc - optind != 6 || heartbeatIntervalNs == 0) {
+        fprintf(stderr, "Correct Format is: %s [-d spool dir] [-i heartbeat ms] [-t timeout ms] "
+                "[relay port A] [host A] [port A] [relay port B] [host B] [port B]\n", argv[0]);
+        return 1;
+    }
+    if (mkdir(spoolDir, 0755) < 0 && errno != EEXIST) {
+        perror("Failed to create the spool directory");
+        return 1;
+    }
+
+    char** args = argv + optind;
+    sides[0].other = &sides[1];
+    sides[1].other = &sides[0];
+    if (openSide(&sides[0], "A", spoolDir, args[0], args[1], args[2]) < 0
+            || openSide(&sides[1], "B", spoolDir, args[3], args[4], args[5]) < 0) {
+        return 1;
+    }
+    fflush(stdout);
+
+    //threads inherit the blocked signals, so only sigwait below sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    for (int i = 0; i < 2; i++) {
+        //wake up now and then to notice the relay stopping
+        struct timeval tv = { 0, 200000 };
+        setsockopt(sides[i].s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        pthread_create(&sides[i].receiver, NULL, receiveThread, &sides[i]);
+        pthread_create(&sides[i].deliverer, NULL, deliverThread, &sides[i]);
+    }
+
+    int sig;
+    sigwait(&signals, &sig);
+    stopping = true;
+    for (int i = 0; i < 2; i++) {
+        pthread_mutex_lock(&sides[i].ackMutex);
+        pthread_cond_broadcast(&sides[i].ackFlag);
+        pthread_mutex_unlock(&sides[i].ackMutex);
+        Spool_wake(&sides[i].outbox);
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_join(sides[i].receiver, NULL);
+        pthread_join(sides[i].deliverer, NULL);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        Side* side = &sides[i];
+        uint64_t syncs = side -> outbox.syncs;
+        printf("to %s: %llu lines spooled, %llu delivered, %llu resent, %llu still waiting, %llu syncs",
+               side -> name, (unsigned long long)side -> spooled, (unsigned long long)side -> delivered,
+               (unsigned long long)side -> resent, (unsigned long long)Spool_pending(&side -> outbox),
+               (unsigned long long)syncs);
+        if (syncs > 0) {
+            printf(" (%.1f lines per sync)", (double)side -> spooled / syncs);
+        }
+        printf("\n");
+        Spool_close(&side -> outbox);
+        freeaddrinfo(side -> dest);
+        close(side -> s);
+    }
+    return 0;
+}
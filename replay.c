@@ -0,0 +1,268 @@
+// s-talk-replay: re-injects a capture taken with "s-talk -c" against a running s-talk
+//
+// usage: s-talk-replay [-s speed] [-d sent|received] [-l local port] [-i probe ms]
+//                      [capture file] [s-talk host] [s-talk port]
+//
+//   -s  1 replays with the original timing (default), 2 twice as fast, 0.5 half speed,
+//       0 as fast as possible
+//   -d  which half of the capture to inject (default: what the captured side sent)
+//   -l  local port to bind; start the s-talk under test with this as its remote port so its
+//       replies come back here (default 0: any port, no latency measurement)
+//   -i  heartbeat probe interval in ms while replaying (default 10, 0 = off)
+//
+// Chat records are re-sent as captured (trace headers are re-stamped with the current time,
+// ids kept); captured heartbeats and goodbyes are left out since they belonged to the old
+// session. While replaying, the tool probes s-talk with its own PINGs: the PONG has to go
+// through s-talk's getMsgThread, send lanes and sendMsgThread, so the round trip measures how
+// s-talk's queues hold up under the replayed load. The tool answers s-talk's own probes too,
+// so the instance under test sees a live peer.
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "capture.h"
+#include "proto.h"
+#include "stats.h"
+
+//Socket and destination shared by the replay loop and the reply thread
+static int s;
+static struct addrinfo* target;
+static volatile bool done = false;
+
+//Probe bookkeeping: only PONGs for sequence numbers we handed out count
+static uint32_t probesSent = 0;
+static Hist rtt;
+static Hist lag;
+static atomic_uint_fast64_t repliesReceived;
+
+static void sendDatagram(const char* datagram, size_t len) {
+    if (sendto(s, datagram, len, 0, target -> ai_addr, target -> ai_addrlen) < 0 && errno != ECONNREFUSED) {
+        perror("Failed to send to s-talk");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void sendProbe(void) {
+    char datagram[64];
+    char payload[PROTO_PROBE_SIZE];
+    ProtoProbe probe = { __atomic_add_fetch(&probesSent, 1, __ATOMIC_RELAXED), Proto_now_ns() };
+    Proto_put_probe(payload, &probe);
+    size_t len = Proto_begin(datagram);
+    len = Proto_put(datagram, len, sizeof(datagram), PROTO_PING, 0, payload, sizeof(payload));
+    sendDatagram(datagram, len);
+}
+
+//Collects PONGs for our probes and answers s-talk's PINGs
+static void* replyThread(void* arg) {
+    char buffer[PROTO_MAX_DATAGRAM];
+    struct timeval tv = { 0, 100000 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (!done) {
+        ssize_t len = recv(s, buffer, sizeof(buffer), 0);
+        if (len < 0) {
+            continue;
+        }
+        uint64_t now = Proto_now_ns();
+        atomic_fetch_add_explicit(&repliesReceived, 1, memory_order_relaxed);
+
+        size_t off = 0;
+        ProtoRecord record;
+        while (Proto_next(buffer, (size_t)len, &off, &record)) {
+            ProtoProbe probe;
+            if (record.type == PROTO_PONG && Proto_get_probe(&record, &probe)
+                    && probe.seq != 0 && probe.seq <= __atomic_load_n(&probesSent, __ATOMIC_RELAXED)
+                    && probe.sentNs <= now) {
+                Hist_record(&rtt, now - probe.sentNs);
+            } else if (record.type == PROTO_PING) {
+                char reply[64];
+                size_t replyLen = Proto_begin(reply);
+                replyLen = Proto_put(reply, replyLen, sizeof(reply), PROTO_PONG, 0, record.payload, record.len);
+                if (replyLen > 0) {
+                    sendDatagram(reply, replyLen);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+//Rebuilds a captured datagram with only its chat records. Returns the new length (0 if nothing
+//is left) and adds the number of chat lines and their bytes to the totals.
+static size_t rebuild(const CaptureRecord* pRecord, char* out, uint64_t* pMessages, uint64_t* pBytes) {
+    size_t len = Proto_begin(out);
+    size_t off = 0;
+    bool any = false;
+    ProtoRecord record;
+    while (Proto_next(pRecord -> data, pRecord -> len, &off, &record)) {
+        if (record.type != PROTO_TEXT) {
+            continue;
+        }
+        //a relay's sequence numbers mean nothing to the s-talk the capture is replayed into
+        uint64_t seq;
+        Proto_get_seq(&record, &seq);
+        ProtoTrace trace;
+        size_t next;
+        if (Proto_get_trace(&record, &trace)) {
+            //the capture's timestamps are long gone, the replayed line counts as typed just now
+            trace.typedNs = trace.sentNs = Proto_realtime_ns();
+            next = Proto_put_traced(out, len, PROTO_MAX_DATAGRAM, PROTO_TEXT, &trace, record.payload, record.len);
+        } else {
+            next = Proto_put(out, len, PROTO_MAX_DATAGRAM, PROTO_TEXT, 0, record.payload, record.len);
+        }
+        if (next == 0) {
+            break;
+        }
+        len = next;
+        any = true;
+        (*pMessages)++;
+        *pBytes += record.len;
+    }
+    return any ? len : 0;
+}
+
+//Sleeps until the monotonic deadline, spinning for the last stretch so early wakeups don't
+//skew the replayed timing
+static void waitUntil(uint64_t deadlineNs) {
+    uint64_t now = Proto_now_ns();
+    if (deadlineNs > now + 200000) {
+        uint64_t sleepNs = deadlineNs - now - 100000;
+        struct timespec ts = { (time_t)(sleepNs / 1000000000ull), (long)(sleepNs % 1000000000ull) };
+        nanosleep(&ts, NULL);
+    }
+    while (Proto_now_ns() < deadlineNs) {
+    }
+}
+
+int main(int argc, char *argv[]) {
+    double speed = 1.0;
+    enum CaptureDir dir = CAPTURE_SENT;
+    int localPort = 0;
+    uint64_t probeIntervalNs = 10000000ull;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:l:i:")) != -1) {
+        switch (opt) {
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'd':
+                dir = strcmp(optarg, "received") == 0 ? CAPTURE_RECEIVED : CAPTURE_SENT;
+                break;
+            case 'l':
+                localPort = atoi(optarg);
+                break;
+            case 'i':
+                probeIntervalNs = strtoull(optarg, NULL, 10) * 1000000ull;
+                break;
+            default:
+                argc = 0;
+                break;
+        }
+    }
+    if (argc - optind != 3 || speed < 0) {
+        fprintf(stderr, "Correct Format is: %s [-s speed (1 = original, 0 = max)] [-d sent|received] "
+                "[-l local port] [-i probe ms] [capture file] [s-talk host] [s-talk port]\n", argv[0]);
+        return 1;
+    }
+
+    CaptureReader reader;
+    if (Capture_reader_open(&reader, argv[optind]) < 0) {
+        perror("Failed to open the capture");
+        return 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &target) != 0) {
+        fprintf(stderr, "Failed to resolve %s\n", argv[optind + 1]);
+        return 1;
+    }
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(localPort);
+    local.sin_addr.s_addr = INADDR_ANY;
+    if (s < 0 || bind(s, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        perror("Failed to bind the replay socket");
+        return 1;
+    }
+
+    pthread_t replies;
+    pthread_create(&replies, NULL, replyThread, NULL);
+
+    static CaptureRecord record;
+    char datagram[PROTO_MAX_DATAGRAM];
+    uint64_t datagrams = 0, messages = 0, bytes = 0;
+    uint64_t start = Proto_now_ns();
+    uint64_t nextProbe = start;
+    bool first = true;
+    uint64_t firstNs = 0;
+
+    while (Capture_next(&reader, &record)) {
+        if (record.dir != dir) {
+            continue;
+        }
+        size_t len = rebuild(&record, datagram, &messages, &bytes);
+        if (len == 0) {
+            continue;
+        }
+        if (first) {
+            firstNs = record.timeNs;
+            first = false;
+        }
+
+        if (speed > 0) {
+            uint64_t due = start + (uint64_t)((double)(record.timeNs - firstNs) / speed);
+            //keep probing while waiting through quiet stretches of the capture
+            while (probeIntervalNs > 0 && nextProbe < due) {
+                waitUntil(nextProbe);
+                sendProbe();
+                nextProbe += probeIntervalNs;
+            }
+            waitUntil(due);
+            Hist_record(&lag, Proto_now_ns() - due);
+        }
+        if (probeIntervalNs > 0 && Proto_now_ns() >= nextProbe) {
+            sendProbe();
+            nextProbe = Proto_now_ns() + probeIntervalNs;
+        }
+
+        sendDatagram(datagram, len);
+        datagrams++;
+    }
+    double seconds = (double)(Proto_now_ns() - start) / 1e9;
+    Capture_reader_close(&reader);
+
+    //a last probe after the load, then give stragglers time to come back
+    if (probeIntervalNs > 0) {
+        sendProbe();
+    }
+    usleep(500000);
+    done = true;
+    pthread_join(replies, NULL);
+
+    printf("replayed %llu datagrams, %llu messages, %llu bytes in %.3f s\n", (unsigned long long)datagrams,
+           (unsigned long long)messages, (unsigned long long)bytes, seconds);
+    printf("throughput: %.0f messages/s, %.0f datagrams/s, %.2f MB/s\n", seconds > 0 ? messages / seconds : 0.0,
+           seconds > 0 ? datagrams / seconds : 0.0, seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+    printf("probes: %u sent, %llu datagrams back from s-talk\n", probesSent,
+           (unsigned long long)atomic_load(&repliesReceived));
+    if (speed > 0) {
+        Hist_print(stdout, "schedule lag", &lag);
+    }
+    Hist_print(stdout, "s-talk round trip under load", &rtt);
+
+    freeaddrinfo(target);
+    close(s);
+    return 0;
+}
@@ -1,33 +1,193 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 #include "list.h"
+#include "capture.h"
+#include "lanes.h"
+#include "proto.h"
+#include "peer.h"
+#include "shm.h"
+#include "stats.h"
+#include "uring.h"
 
 //Initialize lists and ports as global variables to be used in all threads
-List* sendList;
-List* receiveList;
+//(each "list" is a set of priority lanes, see lanes.h)
+Lanes sendList;
+Lanes receiveList;
 int myPort;
 const char *otherMachineName;
 int otherMachinePort;
 
+//the remote machine's address (resolved once in main) and our UDP socket bound to myPort. Both
+//threads use the socket, so what we send comes from myPort and the peer can tell it is us.
+struct addrinfo* remote;
+int udpSocket;
+
+//what the remote machine understands (see proto.h): framed datagrams only go out once it has
+//sent us something framed or our hello, until then it gets raw lines like an original s-talk
+enum { FRAMING_UNKNOWN, FRAMING_LEGACY, FRAMING_FRAMED };
+atomic_int peerFraming = FRAMING_UNKNOWN;
+
 //thread synchronizing using mutex
 pthread_mutex_t sendListMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t receiveListMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t sendListFlag = PTHREAD_COND_INITIALIZER;
 pthread_cond_t receiveListFlag = PTHREAD_COND_INITIALIZER;
+pthread_cond_t sendListSpace = PTHREAD_COND_INITIALIZER;
+pthread_cond_t receiveListSpace = PTHREAD_COND_INITIALIZER;
 
 //exit s-talk signal/flag
 bool exit_s_talk = false;
 
+//heartbeat settings (see peer.h), changed with -i and -t
+uint64_t heartbeatIntervalNs = 1000000000ull;
+uint64_t peerTimeoutNs = 5000000000ull;
+
+//RTT and liveness estimates for the remote machine
+Peer peer;
+
+//use the io_uring backend for socket and terminal I/O (-u), falls back per thread if unavailable
+bool ioUringEnabled = false;
+
+//add a trace header (id + typed and send timestamps) to every chat line we send (-T)
+bool traceEnabled = false;
+
+//low-latency mode (-b): how long a thread spins looking for work before it blocks, 0 = never spin.
+//The same value (in microseconds) is handed to SO_BUSY_POLL on the receiving socket.
+uint64_t spinNs = 0;
+
+//core each thread is pinned to (-a key,send,recv,screen), -1 leaves the thread floating
+enum { CORE_KEY, CORE_SEND, CORE_RECV, CORE_SCREEN, CORE_COUNT };
+int threadCores[CORE_COUNT] = { -1, -1, -1, -1 };
+
+//shared memory transport to a peer on this host (-m), see shm.h. Only ever used when the remote
+//machine name resolves to one of our own addresses (main turns it off otherwise); on only differs
+//from auto in saying so when that rules it out.
+enum { SHM_OFF, SHM_AUTO, SHM_ON };
+int shmMode = SHM_AUTO;
+
+//Most messages/datagrams a thread handles per wakeup (and per io_uring submission)
+#define IO_BATCH 32
+
+//Coalescing delay bounds: how long sendMsgThread may hold a part-filled datagram back while a
+//backlog is building, and at most this fraction of the peer's smoothed RTT
+#define COALESCE_MIN_NS 20000ull
+#define COALESCE_MAX_NS 500000ull
+#define COALESCE_RTT_FRACTION 4
+
+//Chat lines receiveList holds before getMsgThread waits for screenOutputThread. While it waits
+//the PINGs, PONGs and goodbyes in later datagrams wait too, so this is kept big enough (about
+//what the socket buffer held when it was the overflow) that only a screen stuck for a long time
+//pushes back on the peer.
+#define RECV_QUEUE_MAX_DATA 16384
+
+//Receive socket buffer asked for, UDP has no flow control so bursts beyond it are lost
+#define RECV_SOCKET_BUFFER (1 << 20)
+
+//Provided buffers kept posted for the multishot receive
+#define RECV_BUFFERS 64
+#define RECV_BUFFER_GROUP 1
+
+//Hellos sent while we don't know whether the peer understands framing: the first right away,
+//then with the interval doubling each time, so an original s-talk only shows a handful of them
+#define HELLO_COUNT 4
+#define HELLO_INTERVAL_NS 1000000000ull
+
+//How often sendMsgThread tries to (re)connect to the peer's ring, and checks that it is still there
+#define SHM_RETRY_NS 100000000ull
+
+//How long sendMsgThread sleeps between looks at a full ring
+#define SHM_FULL_SLEEP_NS 50000
+
+//Adds a message to its lane and wakes up the thread waiting on the lanes.
+//Returns false (and frees the message) if there was no room for it.
+static bool enqueueMessage(Lanes* pLanes, pthread_mutex_t* pMutex, pthread_cond_t* pFlag, Message* message) {
+    pthread_mutex_lock(pMutex);
+    bool queued = Lanes_push(pLanes, message) == LIST_SUCCESS;
+    pthread_cond_signal(pFlag);
+    pthread_mutex_unlock(pMutex);
+    if (!queued) {
+        free(message);
+    }
+    return queued;
+}
+
+//Like enqueueMessage, but waits for the lanes to have room for a data message instead of
+//dropping it, so a slow consumer pushes back on the producer (and the socket buffer).
+//Returns true if it had to wait.
+static bool enqueueMessageWait(Lanes* pLanes, pthread_mutex_t* pMutex, pthread_cond_t* pFlag,
+                               pthread_cond_t* pSpace, Message* message) {
+    pthread_mutex_lock(pMutex);
+    bool waited = false;
+    while (!Lanes_has_room(pLanes) && exit_s_talk==false) {
+        waited = true;
+        pthread_cond_wait(pSpace, pMutex);
+    }
+    if (Lanes_push(pLanes, message) != LIST_SUCCESS) {
+        free(message);
+    }
+    pthread_cond_signal(pFlag);
+    pthread_mutex_unlock(pMutex);
+    return waited;
+}
+
+//Queues a status line for screenOutputThread, ahead of any chat waiting to be printed
+static void postNotice(const char* text) {
+    Message* notice = Message_create(PROTO_NOTICE, text, (uint16_t)strlen(text));
+    if (notice != NULL) {
+        enqueueMessage(&receiveList, &receiveListMutex, &receiveListFlag, notice);
+    }
+}
+
+//Sets up an io_uring for the calling thread, or explains why the thread uses plain syscalls
+static bool startUring(Uring* pRing, const char* threadName) {
+    if (!ioUringEnabled) {
+        return false;
+    }
+    if (Uring_init(pRing, IO_BATCH * 2) < 0) {
+        fprintf(stderr, "%s: io_uring unavailable (%s), using plain syscalls\n", threadName, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+//Turns a monotonic deadline into the CLOCK_REALTIME timespec pthread_cond_timedwait expects
+static struct timespec realtimeDeadline(uint64_t deadlineNs) {
+    struct timespec ts;
+    uint64_t now = Proto_now_ns();
+    uint64_t wait = deadlineNs > now ? deadlineNs - now : 0;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += wait / 1000000000ull;
+    ts.tv_nsec += wait % 1000000000ull;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
 
 void* keyInputThread(void* arg) {
     char buffer[1024];
-    puts("Enter your messages below (exit by typing '!'): \n");
+    //the data lane of the current burst of input, and whether the last piece ended mid-line
+    bool burstBulk = false;
+    bool continuing = false;
+    uint64_t lastReadNs = 0;
+    puts("Enter your messages below (exit by typing '!', show stats with '!stats'): \n");
     while (1) {
         if (fgets(buffer, sizeof(buffer), stdin) == NULL) {
             perror("Error on input read");
@@ -35,11 +195,15 @@ void* keyInputThread(void* arg) {
         }
 
         if (strcmp(buffer, "!\n") == 0) {
-            //signal that user exits
-            pthread_mutex_lock(&sendListMutex);
-            exit_s_talk=true;
-            pthread_cond_signal(&sendListFlag);
-            pthread_mutex_unlock(&sendListMutex);
+            //signal that user exits: the goodbye jumps the queue on the control lane and
+            //sendMsgThread shuts down once it is out
+            Message* bye = Message_create(PROTO_BYE, NULL, 0);
+            if (bye == NULL || !enqueueMessage(&sendList, &sendListMutex, &sendListFlag, bye)) {
+                pthread_mutex_lock(&sendListMutex);
+                exit_s_talk=true;
+                pthread_cond_signal(&sendListFlag);
+                pthread_mutex_unlock(&sendListMutex);
+            }
             break;
         }
 
@@ -48,60 +212,269 @@ void* keyInputThread(void* arg) {
             break;
         }
 
+        if (strcmp(buffer, "!stats\n") == 0) {
+            Stats_print(stdout, &peer, atomic_load(&peerFraming) == FRAMING_LEGACY);
+            continue;
+        }
 
-        char* message = strdup(buffer);
-
-        pthread_mutex_lock(&sendListMutex);
-
-        List_append(sendList, message);
-
-        //signal that sendList is not empty
-        pthread_cond_signal(&sendListFlag);
+        size_t len = strlen(buffer);
+        Message* message = Message_create(PROTO_TEXT, buffer, (uint16_t)len);
+        if (message == NULL) {
+            perror("Failed to allocate message");
+            exit(EXIT_FAILURE);
+        }
+        //pick the lane once per burst, so the lines of a paste (and the pieces fgets cuts a
+        //long line into) go out in the order they were read
+        if (!continuing && Proto_now_ns() - lastReadNs >= LANE_BURST_GAP_NS) {
+            struct pollfd pending = { STDIN_FILENO, POLLIN, 0 };
+            burstBulk = len >= LANE_BULK_THRESHOLD || poll(&pending, 1, 0) > 0;
+        }
+        message -> bulk = burstBulk;
+        continuing = len > 0 && buffer[len - 1] != '\n';
+        if (traceEnabled) {
+            //the trace starts at the keypress, so the peer sees our queueing too
+            message -> typedNs = Proto_realtime_ns();
+        }
 
-        pthread_mutex_unlock(&sendListMutex);
-        
+        //signal that sendList is not empty (waits for room rather than dropping input)
+        enqueueMessageWait(&sendList, &sendListMutex, &sendListFlag, &sendListSpace, message);
+        //time spent waiting for room doesn't end a burst
+        lastReadNs = Proto_now_ns();
     }
     pthread_cancel(pthread_self());
     return NULL;
 }
 
-void* sendMsgThread(void *arg) {
+//An unreachable peer is reported by the heartbeat, anything else on send is fatal
+static void checkSendResult(int err) {
+    if (err == 0 || err == ECONNREFUSED) {
+        return;
+    }
+    errno = err;
+    perror("Message failed on send");
+    exit(EXIT_FAILURE);
+}
 
-    int s;
-    struct addrinfo hints, *res, *p;
-    char portStr[10];
-    snprintf(portStr, sizeof(portStr), "%d", otherMachinePort);
+//Sends a batch of datagrams with one sendto each
+static void sendDatagrams(int s, struct addrinfo* p, char datagrams[][PROTO_MAX_DATAGRAM], size_t* lens, int count) {
+    for (int i = 0; i < count; i++) {
+        STATS_ADD(ioSyscalls, 1);
+        if (sendto(s, datagrams[i], lens[i], 0, p->ai_addr, p->ai_addrlen) < 0) {
+            checkSendResult(errno);
+            continue;
+        }
+        STATS_ADD(datagramsSent, 1);
+        Capture_record(CAPTURE_SENT, datagrams[i], lens[i]);
+    }
+}
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM;
+//Sends a batch of datagrams with a single io_uring_enter that also waits for all completions.
+//Returns false if the kernel turned the sends down (too old for IORING_OP_SENDMSG, or the ring
+//failed); whatever didn't go out has been sent with sendto and the caller should stop using
+//the ring.
+static bool sendDatagramsUring(Uring* pRing, int s, struct addrinfo* p, char datagrams[][PROTO_MAX_DATAGRAM],
+                               size_t* lens, int count) {
+    struct msghdr msgs[IO_BATCH + 1];
+    struct iovec iovs[IO_BATCH + 1];
+    if (count == 0) {
+        return true;
+    }
+    for (int i = 0; i < count; i++) {
+        iovs[i].iov_base = datagrams[i];
+        iovs[i].iov_len = lens[i];
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_name = p->ai_addr;
+        msgs[i].msg_namelen = p->ai_addrlen;
+        msgs[i].msg_iov = &iovs[i];
+        msgs[i].msg_iovlen = 1;
+        Uring_prep_sendmsg(Uring_get_sqe(pRing), s, &msgs[i], (uint64_t)i);
+    }
+    STATS_ADD(ioSyscalls, 1);
+    if (Uring_submit(pRing, (unsigned)count) < 0) {
+        perror("sendMsgThread: io_uring submit failed, using plain syscalls");
+        sendDatagrams(s, p, datagrams, lens, count);
+        return false;
+    }
+    //the kernel has finished with msgs/iovs once every completion is in
+    bool supported = true;
+    for (int done = 0; done < count; ) {
+        struct io_uring_cqe* cqe = Uring_peek_cqe(pRing);
+        if (cqe == NULL) {
+            STATS_ADD(ioSyscalls, 1);
+            Uring_submit(pRing, (unsigned)(count - done));
+            continue;
+        }
+        if (cqe -> res == -EINVAL || cqe -> res == -EOPNOTSUPP) {
+            supported = false;
+            sendDatagrams(s, p, &datagrams[cqe -> user_data], &lens[cqe -> user_data], 1);
+        } else if (cqe -> res < 0) {
+            checkSendResult(-cqe -> res);
+        } else {
+            STATS_ADD(datagramsSent, 1);
+            Capture_record(CAPTURE_SENT, datagrams[cqe -> user_data], lens[cqe -> user_data]);
+        }
+        Uring_cqe_seen(pRing);
+        done++;
+    }
+    if (!supported) {
+        fprintf(stderr, "sendMsgThread: io_uring can't send here, using plain syscalls\n");
+    }
+    return supported;
+}
 
-    if (getaddrinfo(otherMachineName, portStr, &hints, &res) != 0) {
-        perror("Failed to resolve the other machine's host");
-        exit(EXIT_FAILURE);
+//Moves the PINGs and PONGs out of count framed datagrams into a datagram of their own and sends
+//that over UDP. The records left behind keep their order.
+static void sendProbesAhead(int s, struct addrinfo* p, char datagrams[][PROTO_MAX_DATAGRAM], size_t* lens, int count) {
+    char probes[1][PROTO_MAX_DATAGRAM];
+    size_t probesLen = Proto_begin(probes[0]);
+    for (int i = 0; i < count; i++) {
+        if (lens[i] == 0 || (uint8_t)datagrams[i][0] != PROTO_MAGIC) {
+            continue;
+        }
+        //records only ever move towards the front, so the datagram is rewritten in place
+        size_t off = 0;
+        size_t kept = Proto_begin(datagrams[i]);
+        ProtoRecord record;
+        while (Proto_next(datagrams[i], lens[i], &off, &record)) {
+            size_t next = 0;
+            if (record.type == PROTO_PING || record.type == PROTO_PONG) {
+                next = Proto_put(probes[0], probesLen, PROTO_MAX_DATAGRAM, record.type, record.flags,
+                                 record.payload, record.len);
+                probesLen = next > 0 ? next : probesLen;
+            }
+            if (next == 0) {
+                memmove(datagrams[i] + kept, record.payload - PROTO_RECORD_HEADER, PROTO_RECORD_HEADER + record.len);
+                kept += PROTO_RECORD_HEADER + record.len;
+            }
+        }
+        lens[i] = kept;
     }
+    if (probesLen > 1) {
+        STATS_ADD(shmProbesAhead, 1);
+        sendDatagrams(s, p, probes, &probesLen, 1);
+    }
+}
 
-    for (p = res; p != NULL; p = p->ai_next) {
-        s = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (s < 0) {
-            perror("Failed to create socket");
+//Writes a batch of datagrams into the peer's shared memory ring. A full ring (the peer's
+//getMsgThread is behind) is waited out for as long as the peer keeps it open, since going
+//around it would put lines out of order; only the heartbeats and PONGs on board go ahead over
+//UDP. Returns how many were written; the rest (the peer closed the ring, or we are exiting)
+//are for UDP.
+static int sendDatagramsShm(ShmRing* pRing, int conn, int s, struct addrinfo* p, char datagrams[][PROTO_MAX_DATAGRAM],
+                            size_t* lens, int count) {
+    bool waited = false;
+    for (int i = 0; i < count; i++) {
+        while (lens[i] > 1 && !ShmRing_write(pRing, datagrams[i], lens[i])) {
+            if (!waited) {
+                STATS_ADD(shmFullWaits, 1);
+                sendProbesAhead(s, p, datagrams + i, lens + i, count - i);
+                waited = true;
+            }
+            if (exit_s_talk || Shm_closed(conn)) {
+                return i;
+            }
+            struct timespec pause = { 0, SHM_FULL_SLEEP_NS };
+            nanosleep(&pause, NULL);
+        }
+        //nothing left once its probes went ahead
+        if (lens[i] <= 1) {
             continue;
         }
-        break;
+        STATS_ADD(datagramsSent, 1);
+        STATS_ADD(shmSent, 1);
+        Capture_record(CAPTURE_SENT, datagrams[i], lens[i]);
     }
+    return count;
+}
 
-    if (p == NULL) {
-        perror("FAILED TO CREATE SOCKET");
-        exit(EXIT_FAILURE);
+//Tries to reach the peer's getMsgThread through shared memory. Returns the connection or -1.
+static int connectShm(ShmRing* pRing) {
+    int conn = Shm_connect(otherMachinePort, pRing);
+    if (conn >= 0) {
+        //only a framing s-talk offers a ring
+        atomic_store(&peerFraming, FRAMING_FRAMED);
+        postNotice("Sending to the remote machine through shared memory\n");
+    }
+    return conn;
+}
+
+//Drops the shared memory connection, sending goes back to UDP
+static void disconnectShm(ShmRing* pRing, int* pConn) {
+    Shm_release(pRing);
+    close(*pConn);
+    *pConn = -1;
+    postNotice("Sending to the remote machine over UDP\n");
+}
+
+//Takes queued messages off sendList (lock held) until the batch is full, the lanes are empty or a
+//goodbye comes up. packedBytes tracks roughly how much of a datagram they will take, *pControl is
+//set once anything but a chat line was taken.
+static void takeMessages(Message** batch, int* pCount, size_t* pPackedBytes, bool* pSaidBye, bool* pControl) {
+    uint64_t now = Proto_now_ns();
+    while (*pCount < IO_BATCH && !*pSaidBye && Lanes_count(&sendList) > 0) {
+        Message* message = Lanes_pop(&sendList);
+        Hist_record(&stats.sendQueue, now - message -> queuedNs);
+        *pPackedBytes += PROTO_RECORD_HEADER + message -> len;
+        *pSaidBye = message -> type == PROTO_BYE;
+        *pControl = *pControl || message -> type != PROTO_TEXT;
+        batch[(*pCount)++] = message;
     }
+}
+
+//Appends message as one record at offset len of datagram. Returns the new length, 0 if it
+//doesn't fit.
+static size_t putMessage(char* datagram, size_t len, Message* message, const ProtoTrace* pTrace) {
+    if (pTrace != NULL) {
+        return Proto_put_traced(datagram, len, PROTO_MAX_DATAGRAM, message -> type, pTrace, message -> data,
+                                message -> len);
+    }
+    return Proto_put(datagram, len, PROTO_MAX_DATAGRAM, message -> type, 0, message -> data, message -> len);
+}
+
+void* sendMsgThread(void *arg) {
+
+    int s = udpSocket;
+    struct addrinfo* p = remote;
+
+    //one datagram per slot, the probe (or hello) gets the extra slot
+    static char datagrams[IO_BATCH + 1][PROTO_MAX_DATAGRAM];
+    size_t lens[IO_BATCH + 1];
+    Message *batch[IO_BATCH];
+    uint64_t nextProbeNs = Proto_now_ns();
+    uint64_t nextHelloNs = nextProbeNs;
+    int hellosSent = 0;
+    uint32_t nextTraceId = 1;
+    uint64_t coalesceNs = COALESCE_MIN_NS;
+
+    Uring ring;
+    bool useRing = startUring(&ring, "sendMsgThread");
+
+    //a peer on this host gets the datagrams through its shared memory ring instead
+    bool shmWanted = shmMode != SHM_OFF;
+    ShmRing shmRing = { NULL, NULL, 0, -1 };
+    int shmConn = shmWanted ? connectShm(&shmRing) : -1;
+    uint64_t nextShmCheckNs = Proto_now_ns() + SHM_RETRY_NS;
 
     while (1) {
+
+        Lanes_spin(&sendList, spinNs, &exit_s_talk);
         
         pthread_mutex_lock(&sendListMutex);
 
-        //stall until sendlist is not empty
-        while (List_count(sendList) == 0 && exit_s_talk==false) {
-            pthread_cond_wait(&sendListFlag, &sendListMutex);  
+        //stall until sendlist is not empty or it is time for the next heartbeat (or hello)
+        bool helloDue = hellosSent <= HELLO_COUNT && atomic_load(&peerFraming) != FRAMING_FRAMED;
+        uint64_t wakeNs = heartbeatIntervalNs > 0 ? nextProbeNs : UINT64_MAX;
+        wakeNs = helloDue && nextHelloNs < wakeNs ? nextHelloNs : wakeNs;
+        while (Lanes_count(&sendList) == 0 && exit_s_talk==false) {
+            if (wakeNs == UINT64_MAX) {
+                pthread_cond_wait(&sendListFlag, &sendListMutex);
+                continue;
+            }
+            if (Proto_now_ns() >= wakeNs) {
+                break;
+            }
+            struct timespec deadline = realtimeDeadline(wakeNs);
+            pthread_cond_timedwait(&sendListFlag, &sendListMutex, &deadline);
         }
         
         if (exit_s_talk==true)
@@ -109,51 +482,717 @@ void* sendMsgThread(void *arg) {
             break;
         }
 
-        char *message = (char *)List_remove(sendList);
+        //take everything that is queued (up to a batch) in one go, in lane priority order
+        int count = 0;
+        bool saidBye = false;
+        bool control = false;
+        size_t packedBytes = 0;
+        uint64_t pickedUp = Proto_now_ns();
+        takeMessages(batch, &count, &packedBytes, &saidBye, &control);
+
+        //a backlog means keyInputThread is outrunning us: if everything still fits in one
+        //datagram, give it a moment to fill the datagram up rather than sending it half empty.
+        //Never with a PONG or goodbye on board (or once one turns up): control isn't held for data.
+        if (count > 1 && count < IO_BATCH && !control && packedBytes < PROTO_MAX_DATAGRAM) {
+            int before = count;
+            uint64_t deadlineNs = pickedUp + coalesceNs;
+            struct timespec deadline = realtimeDeadline(deadlineNs);
+            while (count < IO_BATCH && !control && packedBytes < PROTO_MAX_DATAGRAM && !exit_s_talk
+                    && Proto_now_ns() < deadlineNs) {
+                if (Lanes_count(&sendList) == 0
+                        && pthread_cond_timedwait(&sendListFlag, &sendListMutex, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+                takeMessages(batch, &count, &packedBytes, &saidBye, &control);
+            }
+            STATS_ADD(coalesceWaits, 1);
+            STATS_ADD(coalescedMessages, count - before);
+
+            //wait longer while it pays off, back off when nothing turns up; never more than a
+            //fraction of the round trip, so coalescing can't dominate the latency
+            uint64_t srtt = Peer_srtt_ns(&peer);
+            uint64_t cap = srtt > 0 && srtt / COALESCE_RTT_FRACTION < COALESCE_MAX_NS
+                    ? srtt / COALESCE_RTT_FRACTION : COALESCE_MAX_NS;
+            coalesceNs = count > before ? coalesceNs * 2 : coalesceNs / 2;
+            coalesceNs = coalesceNs < COALESCE_MIN_NS ? COALESCE_MIN_NS : (coalesceNs > cap ? cap : coalesceNs);
+        }
+
+        //room for keyInputThread again
+        pthread_cond_signal(&sendListSpace);
 
         pthread_mutex_unlock(&sendListMutex);
 
-        size_t len = strlen(message);
+        //pack the records back to back, starting a new datagram whenever the next one doesn't fit
+        int datagramCount = 0;
+        int records = 0;
+        bool framed = atomic_load(&peerFraming) == FRAMING_FRAMED;
+        for (int i = 0; i < count; i++) {
+            Message *message = batch[i];
+            if (!framed) {
+                //a peer that may be an original s-talk gets one raw line per datagram
+                size_t len = Proto_put_legacy(datagrams[datagramCount], PROTO_MAX_DATAGRAM, message -> type,
+                                              message -> data, message -> len);
+                if (len > 0) {
+                    lens[datagramCount++] = len;
+                    records++;
+                }
+                if (message -> type == PROTO_TEXT) {
+                    STATS_ADD(msgsSent, 1);
+                    STATS_ADD(bytesSent, message -> len);
+                }
+                free(message);
+                continue;
+            }
+            ProtoTrace trace;
+            const ProtoTrace* pTrace = NULL;
+            if (traceEnabled && message -> type == PROTO_TEXT) {
+                trace = (ProtoTrace){ nextTraceId++, message -> typedNs, Proto_realtime_ns() };
+                pTrace = &trace;
+            }
+            size_t len = datagramCount > 0
+                    ? putMessage(datagrams[datagramCount - 1], lens[datagramCount - 1], message, pTrace) : 0;
+            if (len > 0) {
+                lens[datagramCount - 1] = len;
+                records++;
+            } else {
+                len = putMessage(datagrams[datagramCount], Proto_begin(datagrams[datagramCount]), message, pTrace);
+                if (len > 0) {
+                    lens[datagramCount++] = len;
+                    records++;
+                }
+            }
+            if (message -> type == PROTO_TEXT) {
+                STATS_ADD(msgsSent, 1);
+                STATS_ADD(bytesSent, message -> len);
+            }
+            free(message);
+        }
 
-        if (sendto(s, message, len, 0, p->ai_addr, p->ai_addrlen) < 0) {
-            perror("Message failed on send");
-            exit(EXIT_FAILURE);
+        //heartbeat: probe the peer and see whether it has gone quiet, even while busy sending.
+        //Only a framing peer can answer, so there is nothing to probe before that.
+        uint64_t now = Proto_now_ns();
+        if (heartbeatIntervalNs > 0 && now >= nextProbeNs && !framed) {
+            nextProbeNs = now + heartbeatIntervalNs;
+        } else if (heartbeatIntervalNs > 0 && now >= nextProbeNs) {
+            ProtoProbe probe;
+            char payload[PROTO_PROBE_SIZE];
+            Peer_next_probe(&peer, now, &probe);
+            Proto_put_probe(payload, &probe);
+            //ride along in the last datagram if there is room
+            size_t len = datagramCount > 0 ? Proto_put(datagrams[datagramCount - 1], lens[datagramCount - 1],
+                                                       PROTO_MAX_DATAGRAM, PROTO_PING, 0, payload, sizeof(payload)) : 0;
+            if (len > 0) {
+                lens[datagramCount - 1] = len;
+            } else {
+                len = Proto_begin(datagrams[datagramCount]);
+                lens[datagramCount] = Proto_put(datagrams[datagramCount], len, PROTO_MAX_DATAGRAM, PROTO_PING, 0,
+                                                payload, sizeof(payload));
+                datagramCount++;
+            }
+            records++;
+            control = true;
+            nextProbeNs = now + heartbeatIntervalNs;
+
+            if (Peer_check(&peer, now) == PEER_WENT_DOWN) {
+                char notice[80];
+                snprintf(notice, sizeof(notice), "Remote machine is not responding (nothing heard for %llu ms)\n",
+                         (unsigned long long)(peerTimeoutNs / 1000000));
+                postNotice(notice);
+            }
+        }
+
+        //not heard anything framed yet: tell the peer we can do better than raw lines. Once the
+        //hellos have run out (and had time to be answered), a peer sending raw lines is an
+        //original s-talk.
+        if (helloDue && now >= nextHelloNs && atomic_load(&peerFraming) != FRAMING_FRAMED) {
+            if (hellosSent < HELLO_COUNT) {
+                lens[datagramCount] = Proto_put_legacy(datagrams[datagramCount], PROTO_MAX_DATAGRAM, PROTO_HELLO,
+                                                       NULL, 0);
+                datagramCount++;
+                records++;
+                nextHelloNs = now + (HELLO_INTERVAL_NS << hellosSent);
+            } else if (atomic_load(&peerFraming) == FRAMING_LEGACY) {
+                postNotice("Remote machine runs an older s-talk: sending plain lines, no heartbeat\n");
+            }
+            hellosSent++;
+        }
+
+        //the peer may have started after us, or restarted and left our ring behind
+        if (shmWanted && now >= nextShmCheckNs) {
+            if (shmConn < 0) {
+                shmConn = connectShm(&shmRing);
+            } else if (Shm_closed(shmConn)) {
+                disconnectShm(&shmRing, &shmConn);
+            }
+            nextShmCheckNs = now + SHM_RETRY_NS;
+        }
+
+        STATS_ADD(recordsSent, records);
+        int first = 0;
+        if (shmConn >= 0) {
+            first = sendDatagramsShm(&shmRing, shmConn, s, p, datagrams, lens, datagramCount);
+            if (first < datagramCount && Shm_closed(shmConn)) {
+                disconnectShm(&shmRing, &shmConn);
+            }
+        }
+        if (useRing) {
+            if (!sendDatagramsUring(&ring, s, p, datagrams + first, lens + first, datagramCount - first)) {
+                Uring_exit(&ring);
+                useRing = false;
+            }
+        } else {
+            sendDatagrams(s, p, datagrams + first, lens + first, datagramCount - first);
+        }
+
+        if (saidBye) {
+            pthread_mutex_lock(&sendListMutex);
+            exit_s_talk=true;
+            pthread_mutex_unlock(&sendListMutex);
+            break;
         }
     }
 
-    freeaddrinfo(res);
-    close(s);
+    if (useRing) {
+        Uring_exit(&ring);
+    }
+    if (shmConn >= 0) {
+        Shm_release(&shmRing);
+        close(shmConn);
+    }
     
     pthread_cancel(pthread_self());
 }
 
 
+//Pulls the kernel's software receive timestamp (CLOCK_REALTIME ns) out of a SO_TIMESTAMPING
+//control message, 0 if there is none
+static uint64_t kernelTimestamp(struct msghdr* pMsg) {
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(pMsg); cmsg != NULL; cmsg = CMSG_NXTHDR(pMsg, cmsg)) {
+        if (cmsg -> cmsg_level == SOL_SOCKET && cmsg -> cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+            return (uint64_t)stamps.ts[0].tv_sec * 1000000000ull + (uint64_t)stamps.ts[0].tv_nsec;
+        }
+    }
+    return 0;
+}
+
+//Records where the time went for a traced message that just arrived
+static void traceArrival(Message* message, const ProtoTrace* pTrace, uint64_t kernelNs, uint64_t appNs) {
+    static uint32_t lastTraceId = 0;
+    if (lastTraceId != 0 && pTrace -> id != lastTraceId + 1) {
+        STATS_ADD(traceGaps, 1);
+    }
+    lastTraceId = pTrace -> id;
+    STATS_ADD(tracedReceived, 1);
+
+    message -> traceId = pTrace -> id;
+    message -> typedNs = pTrace -> typedNs;
+    message -> sentNs = pTrace -> sentNs;
+
+    //both ends of the send queue stage are the peer's clock, so it is exact
+    if (pTrace -> sentNs >= pTrace -> typedNs) {
+        Hist_record(&stats.traceSendQueue, pTrace -> sentNs - pTrace -> typedNs);
+    }
+
+    //without a kernel timestamp the socket stage folds into the network stage
+    uint64_t arrivedNs = kernelNs != 0 ? kernelNs : appNs;
+    if (arrivedNs >= pTrace -> sentNs) {
+        Hist_record(&stats.traceNetwork, arrivedNs - pTrace -> sentNs);
+    } else {
+        STATS_ADD(traceClockSkew, 1);
+    }
+    if (kernelNs != 0 && appNs >= kernelNs) {
+        Hist_record(&stats.traceSocket, appNs - kernelNs);
+    }
+}
+
+//Records the queue and terminal stages of traced messages once a batch has been printed
+static void tracePrinted(Message** batch, int count, uint64_t pickedUpNs) {
+    bool anyTraced = false;
+    for (int i = 0; i < count && !anyTraced; i++) {
+        anyTraced = batch[i] -> traceId != 0;
+    }
+    if (!anyTraced) {
+        return;
+    }
+
+    //stdout may be fully buffered, the terminal stage ends when the bytes are handed to the kernel
+    fflush(stdout);
+    uint64_t printedNs = Proto_now_ns();
+    uint64_t printedRealNs = Proto_realtime_ns();
+    for (int i = 0; i < count; i++) {
+        Message* message = batch[i];
+        if (message -> traceId == 0) {
+            continue;
+        }
+        Hist_record(&stats.traceQueue, pickedUpNs - message -> queuedNs);
+        Hist_record(&stats.traceTerminal, printedNs - pickedUpNs);
+        if (printedRealNs >= message -> typedNs) {
+            Hist_record(&stats.traceTotal, printedRealNs - message -> typedNs);
+        }
+    }
+}
+
+//True if a datagram from from came from the remote machine (checkPort: from its s-talk's port).
+//NULL means it came through shared memory, which only the peer can write to.
+static bool fromRemote(const struct sockaddr* from, bool checkPort) {
+    if (from == NULL) {
+        return true;
+    }
+    const struct sockaddr_in* in = (const struct sockaddr_in *)from;
+    const struct sockaddr_in* want = (const struct sockaddr_in *)remote -> ai_addr;
+    return in -> sin_family == AF_INET && in -> sin_addr.s_addr == want -> sin_addr.s_addr
+            && (!checkPort || in -> sin_port == want -> sin_port);
+}
+
+//Records what the datagram says about the peer's framing support. A raw line only suggests an
+//original s-talk (a newer one sends raw lines too until it hears from us), so sendMsgThread
+//keeps sending its hellos until they run out.
+static void learnFraming(bool framed) {
+    int expected = FRAMING_UNKNOWN;
+    if (framed) {
+        atomic_store(&peerFraming, FRAMING_FRAMED);
+    } else {
+        atomic_compare_exchange_strong(&peerFraming, &expected, FRAMING_LEGACY);
+    }
+}
+
+//Where the lines from s-talk-relay have got to: the epoch of the spool they come from (0 until
+//the first RELAY record) and the number of the next line to show. Only getMsgThread uses them.
+static uint32_t relayEpoch = 0;
+static uint64_t nextRelaySeq = 0;
+
+//Takes in the datagram's RELAY record and checks that its numbered lines are either shown
+//already or come next in line. Returns false if one is early because a datagram before it was
+//lost; its PING then goes unanswered, so the relay resends the window from the missing line.
+static bool relayInOrder(const char* buffer, size_t len) {
+    uint64_t expected = nextRelaySeq;
+    size_t off = 0;
+    ProtoRecord record;
+    while (Proto_next(buffer, len, &off, &record)) {
+        ProtoRelay relay;
+        uint64_t seq;
+        if (record.type == PROTO_RELAY && Proto_get_relay(&record, &relay)) {
+            //a new epoch means the relay's numbering started over (its spool was wiped). In the
+            //same epoch everything below base is confirmed, so a restarted s-talk skips to it.
+            if (relay.epoch != relayEpoch || relay.base > nextRelaySeq) {
+                relayEpoch = relay.epoch;
+                nextRelaySeq = relay.base;
+            }
+            expected = nextRelaySeq;
+        } else if (record.type == PROTO_TEXT && relayEpoch != 0 && Proto_get_seq(&record, &seq)) {
+            if (seq > expected) {
+                return false;
+            }
+            expected = seq == expected ? expected + 1 : expected;
+        }
+    }
+    return true;
+}
+
+//Handles every record of one received datagram. kernelNs is the kernel's receive timestamp
+//(CLOCK_REALTIME, 0 if unknown) and from its source address (NULL for shared memory).
+//Returns true if the peer said goodbye.
+static bool handleDatagram(const char* buffer, size_t len, uint64_t kernelNs, const struct sockaddr* from) {
+    uint64_t now = Proto_now_ns();
+    uint64_t appNs = Proto_realtime_ns();
+    Capture_record(CAPTURE_RECEIVED, buffer, len);
+    STATS_ADD(datagramsReceived, 1);
+
+    //only the configured peer counts as a sign of life. An original s-talk sends from whatever
+    //port its socket was given, so its raw lines (and framing) are taken from its host alone.
+    bool framed = len > 0 && (uint8_t)buffer[0] == PROTO_MAGIC;
+    bool fromPeerHost = fromRemote(from, false);
+    if ((fromRemote(from, true) || (fromPeerHost && !framed)) && Peer_heard(&peer, now) == PEER_CAME_UP) {
+        postNotice("Remote machine is responding\n");
+    }
+    if (framed && fromPeerHost) {
+        learnFraming(true);
+    }
+
+    //a datagram may carry several records. The control records go first, so a PING or a goodbye
+    //never waits behind a line that is waiting for room on the screen.
+    bool inOrder = relayInOrder(buffer, len);
+    bool peerExited = false;
+    size_t off = 0;
+    ProtoRecord record;
+    while (!peerExited && Proto_next(buffer, len, &off, &record)) {
+        STATS_ADD(recordsReceived, 1);
+        if (record.type == PROTO_HELLO) {
+            if (fromPeerHost) {
+                learnFraming(true);
+            }
+        } else if (record.type == PROTO_BYE) {
+            postNotice("Remote machine has left the chat\n");
+            peerExited = true;
+        } else if (record.type == PROTO_PING && inOrder) {
+            //echo the probe back untouched through the send path
+            Message* pong = Message_create(PROTO_PONG, record.payload, record.len);
+            if (pong != NULL) {
+                enqueueMessage(&sendList, &sendListMutex, &sendListFlag, pong);
+                STATS_ADD(pingsAnswered, 1);
+            }
+        } else if (record.type == PROTO_PONG) {
+            ProtoProbe probe;
+            if (Proto_get_probe(&record, &probe)) {
+                Peer_on_pong(&peer, &probe, now);
+            }
+        }
+    }
+    if (!peerExited && off < len) {
+        STATS_ADD(malformed, 1);
+    }
+
+    //then the lines, up to the goodbye if there was one
+    off = 0;
+    while (Proto_next(buffer, len, &off, &record) && record.type != PROTO_BYE) {
+        if (record.type == PROTO_TEXT) {
+            if (!framed && fromPeerHost) {
+                learnFraming(false);
+            }
+            //relayed lines are shown strictly in their order: one numbered below the next we
+            //expect has been shown already, one above it waits for the resend of the lost ones
+            uint64_t seq;
+            if (relayEpoch != 0 && Proto_get_seq(&record, &seq)) {
+                if (seq < nextRelaySeq) {
+                    STATS_ADD(duplicates, 1);
+                    continue;
+                }
+                if (seq > nextRelaySeq) {
+                    STATS_ADD(early, 1);
+                    continue;
+                }
+                nextRelaySeq++;
+            }
+            ProtoTrace trace;
+            bool traced = Proto_get_trace(&record, &trace);
+            Message* message = Message_create(PROTO_TEXT, record.payload, record.len);
+            if (message == NULL) {
+                continue;
+            }
+            if (traced) {
+                traceArrival(message, &trace, kernelNs, appNs);
+            }
+            STATS_ADD(msgsReceived, 1);
+            STATS_ADD(bytesReceived, record.len);
+
+            //signal that receive list is non-empty
+            if (enqueueMessageWait(&receiveList, &receiveListMutex, &receiveListFlag, &receiveListSpace, message)) {
+                STATS_ADD(receiveStalls, 1);
+            }
+        }
+    }
+    return peerExited;
+}
+
+//Receive loop for the io_uring backend: a multishot recvmsg stays armed on the socket and
+//every io_uring_enter reaps however many datagrams arrived in the meantime. Returns false if
+//the kernel can't do this (no provided buffers or multishot recvmsg before Linux 6.0) or the
+//ring fails later on; the caller then carries on with plain syscalls, nothing is lost since
+//unreaped datagrams are still in the socket.
+static bool receiveLoopUring(Uring* pRing, int s) {
+    //only describes the layout of each provided buffer, the kernel never writes through it
+    struct msghdr layout;
+    memset(&layout, 0, sizeof(layout));
+    layout.msg_namelen = sizeof(struct sockaddr_storage);
+    layout.msg_controllen = CMSG_SPACE(sizeof(struct scm_timestamping));
+
+    unsigned bufferSize = sizeof(struct io_uring_recvmsg_out) + layout.msg_namelen + layout.msg_controllen
+                          + PROTO_MAX_DATAGRAM;
+    if (Uring_setup_buffers(pRing, RECV_BUFFERS, bufferSize, RECV_BUFFER_GROUP) < 0) {
+        perror("getMsgThread: io_uring receive buffers unavailable, using plain syscalls");
+        return false;
+    }
+
+    bool armed = false;
+    while (!exit_s_talk) {
+        if (!armed) {
+            Uring_prep_recvmsg_multishot(Uring_get_sqe(pRing), s, &layout, RECV_BUFFER_GROUP, 0);
+            armed = true;
+        }
+        STATS_ADD(ioSyscalls, 1);
+        if (Uring_submit(pRing, 1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("getMsgThread: io_uring wait failed, using plain syscalls");
+            return false;
+        }
+
+        //on a failed request, still hand over the datagrams already reaped before giving up
+        bool failed = false;
+        struct io_uring_cqe* cqe;
+        while ((cqe = Uring_peek_cqe(pRing)) != NULL) {
+            int res = cqe -> res;
+            unsigned flags = cqe -> flags;
+            Uring_cqe_seen(pRing);
+
+            //the request disarms itself on errors and when it runs out of buffers
+            if (!(flags & IORING_CQE_F_MORE)) {
+                armed = false;
+            }
+            if (res < 0) {
+                if (res == -ENOBUFS || res == -ECONNREFUSED) {
+                    continue;
+                }
+                errno = -res;
+                perror("getMsgThread: io_uring receive failed, using plain syscalls");
+                failed = true;
+                continue;
+            }
+            if (!(flags & IORING_CQE_F_BUFFER)) {
+                continue;
+            }
+
+            unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+            size_t len, controlLen;
+            char* control;
+            char* payload = Uring_recvmsg_payload(Uring_buffer(pRing, id), (unsigned)res, &layout, &len,
+                                                  &control, &controlLen);
+            bool peerExited = false;
+            if (payload != NULL) {
+                struct msghdr received;
+                memset(&received, 0, sizeof(received));
+                received.msg_control = control;
+                received.msg_controllen = controlLen;
+                peerExited = handleDatagram(payload, len, kernelTimestamp(&received),
+                                            Uring_recvmsg_name(Uring_buffer(pRing, id), (unsigned)res,
+                                                               sizeof(struct sockaddr_in)));
+            }
+            Uring_recycle_buffer(pRing, id);
+            if (peerExited) {
+                return true;
+            }
+        }
+        if (failed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//Reads whatever is in the shared memory ring (up to a batch). Returns -1 if the peer said
+//goodbye, SHM_CORRUPT if the ring can't be trusted any more, otherwise how many datagrams there were.
+static int drainShm(ShmRing* pRing, char* buffer, size_t cap) {
+    int count = 0;
+    ssize_t len;
+    while (count < IO_BATCH && (len = ShmRing_read(pRing, buffer, cap)) != 0) {
+        count++;
+        if (len == SHM_CORRUPT) {
+            STATS_ADD(malformed, 1);
+            fprintf(stderr, "Shared memory ring from the remote machine is corrupt, closing it\n");
+            return SHM_CORRUPT;
+        }
+        if (len < 0) {
+            STATS_ADD(malformed, 1);
+            continue;
+        }
+        STATS_ADD(shmReceived, 1);
+        buffer[len] = '\0';
+        if (handleDatagram(buffer, (size_t)len, 0, NULL)) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+//True if the datagram holds a goodbye
+static bool carriesBye(const char* buffer, size_t len) {
+    size_t off = 0;
+    ProtoRecord record;
+    while (Proto_next(buffer, len, &off, &record)) {
+        if (record.type == PROTO_BYE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Receive loop when a local peer may send through shared memory: the ring and the UDP socket are
+//both drained without blocking, and only when both are empty (and any -b spin is over) does the
+//thread sleep in poll on the socket, the ring's eventfd and the unix connections.
+static void receiveLoopShm(int s, int listenFd) {
+    char buffer[PROTO_MAX_DATAGRAM + 1];
+    char byeBuffer[PROTO_MAX_DATAGRAM + 1];
+    ShmRing shmRing = { NULL, NULL, 0, -1 };
+    int conn = -1;
+    uint64_t idleSinceNs = Proto_now_ns();
+
+    while (!exit_s_talk) {
+        bool busy = false;
+        if (conn >= 0) {
+            int count = drainShm(&shmRing, buffer, sizeof(buffer) - 1);
+            if (count == -1) {
+                break;
+            }
+            if (count == SHM_CORRUPT) {
+                //closing the connection sends the writer back to UDP
+                Shm_release(&shmRing);
+                close(conn);
+                conn = -1;
+                continue;
+            }
+            busy = count > 0;
+        }
+
+        for (int i = 0; i < IO_BATCH; i++) {
+            struct iovec iov = { buffer, sizeof(buffer) - 1 };
+            char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+            struct sockaddr_in from;
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_name = &from;
+            msg.msg_namelen = sizeof(from);
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            STATS_ADD(ioSyscalls, 1);
+            ssize_t receivedBytes = recvmsg(s, &msg, MSG_DONTWAIT);
+            if (receivedBytes < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+                    perror("Failed to receive message");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            busy = true;
+            buffer[receivedBytes] = '\0';
+            //a goodbye may have overtaken lines still in the ring, those are shown first
+            if (conn >= 0 && carriesBye(buffer, (size_t)receivedBytes)) {
+                memcpy(byeBuffer, buffer, (size_t)receivedBytes + 1);
+                int count;
+                while ((count = drainShm(&shmRing, buffer, sizeof(buffer) - 1)) > 0) {
+                    busy = true;
+                }
+                if (count == -1) {
+                    goto done;
+                }
+                memcpy(buffer, byeBuffer, (size_t)receivedBytes + 1);
+            }
+            if (handleDatagram(buffer, (size_t)receivedBytes, kernelTimestamp(&msg), (struct sockaddr *)&from)) {
+                goto done;
+            }
+        }
+
+        //low-latency mode: keep looking for a while before going to sleep
+        uint64_t now = Proto_now_ns();
+        if (busy) {
+            idleSinceNs = now;
+            continue;
+        }
+        if (spinNs > 0 && now - idleSinceNs < spinNs) {
+            continue;
+        }
+
+        //the writer only signals the eventfd if we announce we are about to sleep
+        if (conn >= 0 && !ShmRing_prepare_wait(&shmRing)) {
+            continue;
+        }
+        struct pollfd fds[4] = {
+            { s, POLLIN, 0 },
+            { listenFd, POLLIN, 0 },
+            { conn, POLLIN, 0 },
+            { shmRing.eventFd, POLLIN, 0 },
+        };
+        int ready = poll(fds, conn >= 0 ? 4 : 2, -1);
+        if (conn >= 0) {
+            ShmRing_finish_wait(&shmRing);
+        }
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Failed to wait for messages");
+            exit(EXIT_FAILURE);
+        }
+        if (conn >= 0 && fds[3].revents != 0) {
+            STATS_ADD(shmWakeups, 1);
+        }
+
+        //the writer went away (everything it wrote is still in the ring), or a new one turned up
+        if (conn >= 0 && fds[2].revents != 0) {
+            if (drainShm(&shmRing, buffer, sizeof(buffer) - 1) == -1) {
+                break;
+            }
+            Shm_release(&shmRing);
+            close(conn);
+            conn = -1;
+        }
+        if (fds[1].revents != 0) {
+            ShmRing fresh = { NULL, NULL, 0, -1 };
+            int freshConn = Shm_accept(listenFd, &fresh);
+            if (freshConn < 0 && errno == EACCES) {
+                fprintf(stderr, "Turned away a shared memory connection from another user\n");
+            }
+            if (freshConn >= 0) {
+                if (conn >= 0) {
+                    if (drainShm(&shmRing, buffer, sizeof(buffer) - 1) == -1) {
+                        Shm_release(&fresh);
+                        close(freshConn);
+                        break;
+                    }
+                    Shm_release(&shmRing);
+                    close(conn);
+                }
+                shmRing = fresh;
+                conn = freshConn;
+            }
+        }
+    }
+
+done:
+    if (conn >= 0) {
+        Shm_release(&shmRing);
+        close(conn);
+    }
+}
+
 //This function receives the messages sent to it 
 void *getMsgThread(void *arg) {
     int myPort = *(int *)arg;
-    int s;
-    struct sockaddr_in addr, clientAddr; //socket address structure
-    char buffer[1024]; //buffer for messages
-    socklen_t addrLen = sizeof(clientAddr); //client address length
-
-    //create socket
-    s = socket(AF_INET, SOCK_DGRAM, 0);
+    int s = udpSocket; //bound in main, sendMsgThread sends through it too
+    struct sockaddr_in clientAddr; //socket address structure
+    char buffer[PROTO_MAX_DATAGRAM + 1]; //buffer for messages (+1 for the NUL terminator)
+
+    //room for bursts while screenOutputThread catches up (the kernel caps this at net.core.rmem_max)
+    int rcvbuf = RECV_SOCKET_BUFFER;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    //with -T, ask for kernel receive timestamps so traced messages can separate network from
+    //socket time (without it they only cost a control message on every datagram)
+    int timestamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (traceEnabled && setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &timestamping, sizeof(timestamping)) < 0) {
+        perror("SO_TIMESTAMPING not available, traced messages lose the socket stage");
+    }
 
-    if (s < 0) {
-        perror("Socket failed on creation");
-        exit(EXIT_FAILURE);
+    //let the kernel poll the device queue for us instead of sleeping on an interrupt
+    if (spinNs > 0) {
+        int busyPollUs = (int)(spinNs / 1000);
+        if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &busyPollUs, sizeof(busyPollUs)) < 0) {
+            perror("SO_BUSY_POLL not applied (needs CAP_NET_ADMIN above net.core.busy_read)");
+        }
     }
 
-    //adress structure config
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(myPort);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    memset(&addr.sin_zero, '\0', 8);
+    Uring ring;
+    if (startUring(&ring, "getMsgThread")) {
+        bool done = receiveLoopUring(&ring, s);
+        Uring_exit(&ring);
+        if (done) {
+            pthread_exit(NULL);
+        }
+    }
 
-    //bind socket to local address
-    if (bind(s, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0) {
-        perror("Failed to bind");
-        exit(EXIT_FAILURE);
+    //a peer on this host may send through shared memory instead of the socket
+    if (shmMode != SHM_OFF) {
+        int listenFd = Shm_listen(myPort);
+        if (listenFd >= 0) {
+            receiveLoopShm(s, listenFd);
+            close(listenFd);
+            pthread_exit(NULL);
+        }
+        perror("Shared memory transport not available, receiving over UDP only");
     }
 
     //keep running until terminated
@@ -165,7 +1204,33 @@ void *getMsgThread(void *arg) {
             break;
         }
         
-        ssize_t receivedBytes = recvfrom(s, buffer, sizeof(buffer), 0, (struct sockaddr *)&clientAddr, &addrLen);
+        //recvmsg rather than recvfrom so the kernel timestamp comes along with the datagram
+        struct iovec iov = { buffer, sizeof(buffer) - 1 };
+        char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &clientAddr;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        ssize_t receivedBytes = -1;
+
+        //low-latency mode: poll the socket without sleeping for a while before blocking
+        if (spinNs > 0) {
+            uint64_t deadline = Proto_now_ns() + spinNs;
+            do {
+                STATS_ADD(ioSyscalls, 1);
+                msg.msg_namelen = sizeof(clientAddr);
+                msg.msg_controllen = sizeof(control);
+                receivedBytes = recvmsg(s, &msg, MSG_DONTWAIT);
+            } while (receivedBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && Proto_now_ns() < deadline);
+        }
+        if (receivedBytes < 0) {
+            STATS_ADD(ioSyscalls, 1);
+            msg.msg_namelen = sizeof(clientAddr);
+            msg.msg_controllen = sizeof(control);
+            receivedBytes = recvmsg(s, &msg, 0);
+        }
 
         if (receivedBytes < 0) {
             perror("Failed to receive message");
@@ -176,31 +1241,88 @@ void *getMsgThread(void *arg) {
         if (exit_s_talk){
             break;
         }
-        if (strcmp(buffer, "!\n") == 0) {
+
+        if (handleDatagram(buffer, (size_t)receivedBytes, kernelTimestamp(&msg), (struct sockaddr *)&clientAddr)) {
             break;
         }
-
-
-        char* message = strdup(buffer);
-
-        pthread_mutex_lock(&receiveListMutex);
-
-        List_append(receiveList, message);
-
-        //signal that receive list is non-empty
-        pthread_cond_signal(&receiveListFlag);
-
-        pthread_mutex_unlock(&receiveListMutex);
         
         //check cancel flag
         pthread_testcancel();
     }
 
-    close(s); //close socket
+    //the socket stays open for sendMsgThread, main closes it
     pthread_cancel(pthread_self());
 }
 
+//Prints a batch of received messages through stdio
+static void printMessages(Message** batch, int count) {
+    for (int i = 0; i < count; i++) {
+        if (batch[i] -> type == PROTO_TEXT) {
+            fputs("Received message: ", stdout);
+        }
+        fputs(batch[i] -> data, stdout);
+    }
+}
+
+//Prints a batch of received messages with a single io_uring writev to stdout. Returns false
+//(having printed them through stdio instead) if the ring can't write, e.g. a kernel without
+//IORING_OP_WRITEV; the caller should stop using it.
+static bool printMessagesUring(Uring* pRing, Message** batch, int count) {
+    static const char prefix[] = "Received message: ";
+    struct iovec iovs[2 * IO_BATCH];
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        //status notices go out without the prefix
+        size_t prefixLen = batch[i] -> type == PROTO_TEXT ? sizeof(prefix) - 1 : 0;
+        iovs[2 * i].iov_base = (void *)prefix;
+        iovs[2 * i].iov_len = prefixLen;
+        iovs[2 * i + 1].iov_base = batch[i] -> data;
+        iovs[2 * i + 1].iov_len = batch[i] -> len;
+        total += prefixLen + batch[i] -> len;
+    }
+
+    //anything other threads printed through stdio has to come out first
+    fflush(stdout);
+    Uring_prep_writev(Uring_get_sqe(pRing), STDOUT_FILENO, iovs, (unsigned)(2 * count), 0);
+    STATS_ADD(ioSyscalls, 1);
+    int res;
+    if (Uring_submit(pRing, 1) < 0) {
+        res = -errno;
+    } else {
+        struct io_uring_cqe* cqe = Uring_peek_cqe(pRing);
+        res = cqe != NULL ? cqe -> res : -EIO;
+        if (cqe != NULL) {
+            Uring_cqe_seen(pRing);
+        }
+    }
+    if (res < 0) {
+        errno = -res;
+        perror("screenOutputThread: io_uring write failed, using plain syscalls");
+        printMessages(batch, count);
+        return false;
+    }
+
+    //short write (e.g. a full pipe): finish the rest the ordinary way
+    size_t skip = (size_t)res;
+    for (int i = 0; i < 2 * count && skip < total; i++) {
+        if (skip >= iovs[i].iov_len) {
+            skip -= iovs[i].iov_len;
+            total -= iovs[i].iov_len;
+            continue;
+        }
+        fwrite((char *)iovs[i].iov_base + skip, 1, iovs[i].iov_len - skip, stdout);
+        total -= iovs[i].iov_len;
+        skip = 0;
+    }
+    fflush(stdout);
+    return true;
+}
+
 void *screenOutputThread(void *arg) {
+    Message *batch[IO_BATCH];
+    Uring ring;
+    bool useRing = startUring(&ring, "screenOutputThread");
+
     while (1) {
         //check cancel flag
         pthread_testcancel();
@@ -210,10 +1332,12 @@ void *screenOutputThread(void *arg) {
             break;
         }
 
+        Lanes_spin(&receiveList, spinNs, &exit_s_talk);
+
         pthread_mutex_lock(&receiveListMutex);
 
         //stall until receive list non-empty
-        while (List_count(receiveList) == 0 && exit_s_talk==false) {
+        while (Lanes_count(&receiveList) == 0 && exit_s_talk==false) {
             pthread_cond_wait(&receiveListFlag, &receiveListMutex);  
         }
 
@@ -222,28 +1346,106 @@ void *screenOutputThread(void *arg) {
             break;
         }
 
-        char *message = (char *)List_first(receiveList);
-
-        pthread_mutex_unlock(&receiveListMutex);
-
-        if (message != NULL) {
-            fputs("Received message: ", stdout);
-            fputs(message, stdout);
+        //take everything that is waiting (up to a batch) in one go
+        int count = 0;
+        uint64_t pickedUp = Proto_now_ns();
+        while (count < IO_BATCH && Lanes_count(&receiveList) > 0) {
+            batch[count] = Lanes_pop(&receiveList);
+            Hist_record(&stats.receiveQueue, pickedUp - batch[count] -> queuedNs);
+            count++;
+        }
 
-            pthread_mutex_lock(&receiveListMutex);
+        //room for getMsgThread again
+        pthread_cond_signal(&receiveListSpace);
 
-            List_remove(receiveList);
-            //signal receive list non-empty
-            pthread_cond_signal(&receiveListFlag);
+        pthread_mutex_unlock(&receiveListMutex);
 
-            pthread_mutex_unlock(&receiveListMutex);
+        if (useRing && !printMessagesUring(&ring, batch, count)) {
+            Uring_exit(&ring);
+            useRing = false;
+        } else if (!useRing) {
+            printMessages(batch, count);
+        }
+        tracePrinted(batch, count, pickedUp);
+        for (int i = 0; i < count; i++) {
+            free(batch[i]);
         }
         pthread_testcancel();
     }
+
+    if (useRing) {
+        Uring_exit(&ring);
+    }
     
     pthread_exit(NULL);
 }
 
+//Parses "-a key,send,recv,screen" core numbers, missing or negative entries stay floating
+static void parseCores(const char* list) {
+    char* end;
+    for (int i = 0; i < CORE_COUNT && *list != '\0'; i++) {
+        threadCores[i] = (int)strtol(list, &end, 10);
+        if (end == list) {
+            threadCores[i] = -1;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+}
+
+//Creates a thread that starts out pinned to core (or floating if core < 0)
+static int createThread(pthread_t* pThread, int core, void* (*fn)(void*), void* arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (core >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(core, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    int ret = pthread_create(pThread, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    //a core that doesn't exist (or isn't ours) shouldn't stop the chat, just run unpinned
+    if (ret != 0 && core >= 0) {
+        fprintf(stderr, "Cannot pin thread to core %d (%s), leaving it floating\n", core, strerror(ret));
+        ret = pthread_create(pThread, NULL, fn, arg);
+    }
+    return ret;
+}
+
+static sigset_t stopSignals;
+
+//Waits for a signal that would end the process and writes the capture's buffered tail out
+//first, then lets the signal do what it would have done
+static void* signalThread(void* arg) {
+    int sig;
+    if (sigwait(&stopSignals, &sig) != 0) {
+        return NULL;
+    }
+    Capture_close();
+    signal(sig, SIG_DFL);
+    pthread_sigmask(SIG_UNBLOCK, &stopSignals, NULL);
+    raise(sig);
+    return NULL;
+}
+
+//Blocks SIGINT/SIGTERM/SIGHUP in the calling thread (and every thread it creates afterwards)
+//and hands them to signalThread. Returns 0 or an error number.
+static int startSignalThread(void) {
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+    pthread_t signalThreadId;
+    int ret = pthread_create(&signalThreadId, NULL, signalThread, NULL);
+    if (ret == 0) {
+        pthread_detach(signalThreadId);
+    } else {
+        errno = ret;
+    }
+    return ret;
+}
+
 //function to free the dynamically allocated items in the lists
 void freeItems(void*pItem)
 {
@@ -255,14 +1457,109 @@ void freeItems(void*pItem)
 
 int main(int argc, char *argv[]) {
 
-    if (argc != 4) {
-        fprintf(stderr, "Correct Format is: %s [my port number] [remote machine name] [remote port number]\n", argv[0]);
+    int opt;
+    const char* capturePath = NULL;
+    while ((opt = getopt(argc, argv, "a:b:c:i:m:t:uT")) != -1) {
+        switch (opt) {
+            case 'c':
+                capturePath = optarg;
+                break;
+            case 'T':
+                traceEnabled = true;
+                break;
+            case 'a':
+                parseCores(optarg);
+                break;
+            case 'b':
+                spinNs = strtoull(optarg, NULL, 10) * 1000ull;
+                break;
+            case 'u':
+                ioUringEnabled = true;
+                break;
+            case 'm':
+                if (strcmp(optarg, "off") == 0) {
+                    shmMode = SHM_OFF;
+                } else if (strcmp(optarg, "on") == 0) {
+                    shmMode = SHM_ON;
+                } else if (strcmp(optarg, "auto") == 0) {
+                    shmMode = SHM_AUTO;
+                } else {
+                    argc = 0;
+                }
+                break;
+            case 'i':
+                heartbeatIntervalNs = strtoull(optarg, NULL, 10) * 1000000ull;
+                break;
+            case 't':
+                peerTimeoutNs = strtoull(optarg, NULL, 10) * 1000000ull;
+                break;
+            default:
+                argc = 0; //force the usage message below
+                break;
+        }
+    }
+
+    if (argc - optind != 3) {
+        fprintf(stderr, "Correct Format is: %s [-i heartbeat ms (0 = off)] [-t peer timeout ms] [-u use io_uring] "
+                "[-a key,send,recv,screen cores] [-b busy-poll us] [-T trace messages] [-c capture file] "
+                "[-m shared memory auto|on|off] "
+                "[my port number] [remote machine name] [remote port number]\n", argv[0]);
         return 1;  // return an error code
     }
 
-    myPort = atoi(argv[1]);
-    otherMachineName = argv[2];
-    otherMachinePort = atoi(argv[3]);
+    myPort = atoi(argv[optind]);
+    otherMachineName = argv[optind + 1];
+    otherMachinePort = atoi(argv[optind + 2]);
+
+    //IPv4 only, like the receiving socket: a peer we can only reach over IPv6 couldn't answer us
+    struct addrinfo hints;
+    char portStr[10];
+    snprintf(portStr, sizeof(portStr), "%d", otherMachinePort);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(otherMachineName, portStr, &hints, &remote) != 0) {
+        perror("Failed to resolve the other machine's host");
+        return 1;
+    }
+
+    //s-talk-<port> on this host is only the remote machine's s-talk if the remote machine is this
+    //host; otherwise it could be any unrelated session that happens to use that port
+    if (shmMode != SHM_OFF && !Shm_is_local(remote -> ai_addr)) {
+        if (shmMode == SHM_ON) {
+            fprintf(stderr, "%s is not this host, not using shared memory\n", otherMachineName);
+        }
+        shmMode = SHM_OFF;
+    }
+
+    udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udpSocket < 0) {
+        perror("Socket failed on creation");
+        return 1;
+    }
+
+    //bind socket to local address
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(myPort);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(udpSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Failed to bind");
+        return 1;
+    }
+
+    Peer_init(&peer, peerTimeoutNs);
+
+    if (capturePath != NULL && Capture_open(capturePath) < 0) {
+        perror("Failed to open the capture file");
+        return 1;
+    }
+    //before any other thread exists, so they all inherit the blocked signals
+    if (capturePath != NULL && startSignalThread() != 0) {
+        perror("Failed to create the signal thread");
+        return 1;
+    }
 
     printf("My Port: %d\n", myPort);
     printf("Remote Machine: %s\n", otherMachineName);
@@ -270,29 +1567,32 @@ int main(int argc, char *argv[]) {
 
     //generate list instances
 
-    sendList = List_create();
-    receiveList = List_create();
+    if (Lanes_init(&sendList) != LIST_SUCCESS || Lanes_init(&receiveList) != LIST_SUCCESS) {
+        fprintf(stderr, "Failed to create the message lists\n");
+        return 1;
+    }
+    receiveList.maxData = RECV_QUEUE_MAX_DATA;
 
     //declare and generate threads
 
     pthread_t keyInputThreadId, sendMsgThreadId, getMsgThreadId, screenOutputThreadId;
 
-    if (pthread_create(&keyInputThreadId, NULL, keyInputThread, NULL) != 0) {
+    if (createThread(&keyInputThreadId, threadCores[CORE_KEY], keyInputThread, NULL) != 0) {
         perror("Failed to create the keyInputThread");
         return 1;
     }
 
-    if (pthread_create(&sendMsgThreadId, NULL, sendMsgThread, &otherMachinePort) != 0) {
+    if (createThread(&sendMsgThreadId, threadCores[CORE_SEND], sendMsgThread, &otherMachinePort) != 0) {
         perror("Failed to create the sendMsgThread");
         return 1;
     }
 
-    if (pthread_create(&getMsgThreadId, NULL, getMsgThread, &myPort) != 0) {
+    if (createThread(&getMsgThreadId, threadCores[CORE_RECV], getMsgThread, &myPort) != 0) {
         perror("Failed to create the getMsgThread");
         return 1;
     }
 
-    if (pthread_create(&screenOutputThreadId, NULL, screenOutputThread, NULL) != 0) {
+    if (createThread(&screenOutputThreadId, threadCores[CORE_SCREEN], screenOutputThread, NULL) != 0) {
         perror("Failed to create screenOutputThread");
         exit(EXIT_FAILURE);
     }
@@ -301,15 +1601,21 @@ int main(int argc, char *argv[]) {
     pthread_join(keyInputThreadId, NULL);
     pthread_join(sendMsgThreadId, NULL);
 
+    Stats_print(stdout, &peer, atomic_load(&peerFraming) == FRAMING_LEGACY);
+    Capture_close();
+
     // clean up the lists
-    List_free(sendList, freeItems);
-    List_free(receiveList, freeItems);
+    Lanes_free(&sendList, freeItems);
+    Lanes_free(&receiveList, freeItems);
 
     pthread_cancel(keyInputThreadId);
     pthread_cancel(sendMsgThreadId);
     pthread_cancel(getMsgThreadId);
     pthread_cancel(screenOutputThreadId);
 
+    close(udpSocket);
+    freeaddrinfo(remote);
+
     return 0;
 }
 
@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ifaddrs.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include "shm.h"
+
+#define SHM_MAGIC 0x53544b52u // "STKR"
+
+//Length value that tells the reader to skip to the start of the ring
+#define SHM_WRAP UINT32_MAX
+
+#define SHM_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+//Abstract socket address for port (leading NUL, nothing on the file system)
+static socklen_t shmAddress(int port, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr -> sun_family = AF_UNIX;
+    int len = snprintf(addr -> sun_path + 1, sizeof(addr -> sun_path) - 1, "s-talk-%d", port);
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+}
+
+//The abstract namespace has no permissions, anyone on the host can bind or connect: only talk
+//to a process running as our own user. Sets errno to EACCES if the other end isn't one.
+static bool sameUser(int conn) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != geteuid()) {
+        errno = EACCES;
+        return false;
+    }
+    return true;
+}
+
+static int mapRing(ShmRing* pRing, int memFd) {
+    size_t mapped = sizeof(ShmRingHeader) + SHM_RING_SIZE;
+    void* base = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    pRing -> header = base;
+    pRing -> data = (char *)base + sizeof(ShmRingHeader);
+    pRing -> mapped = mapped;
+    return 0;
+}
+
+int Shm_listen(int port) {
+    struct sockaddr_un addr;
+    socklen_t len = shmAddress(port, &addr);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, len) < 0 || listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int Shm_accept(int listenFd, ShmRing* pRing) {
+    int conn = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn < 0) {
+        return -1;
+    }
+    if (!sameUser(conn)) {
+        close(conn);
+        return -1;
+    }
+    //a fresh ring per writer, so a restarted peer never shares one with its previous run
+    int memFd = memfd_create("s-talk-ring", MFD_CLOEXEC);
+    pRing -> eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (memFd < 0 || pRing -> eventFd < 0 || ftruncate(memFd, sizeof(ShmRingHeader) + SHM_RING_SIZE) < 0
+            || mapRing(pRing, memFd) < 0) {
+        goto fail;
+    }
+    pRing -> header -> magic = SHM_MAGIC;
+    pRing -> header -> capacity = SHM_RING_SIZE;
+    atomic_init(&pRing -> header -> head, 0);
+    atomic_init(&pRing -> header -> tail, 0);
+    atomic_init(&pRing -> header -> sleeping, 0);
+
+    //hand over both descriptors in one message
+    int fds[2] = { memFd, pRing -> eventFd };
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg -> cmsg_level = SOL_SOCKET;
+    cmsg -> cmsg_type = SCM_RIGHTS;
+    cmsg -> cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != 1) {
+        goto fail;
+    }
+    close(memFd);
+    return conn;
+
+fail:
+    if (pRing -> header != NULL) {
+        munmap(pRing -> header, pRing -> mapped);
+        pRing -> header = NULL;
+    }
+    if (pRing -> eventFd >= 0) {
+        close(pRing -> eventFd);
+        pRing -> eventFd = -1;
+    }
+    if (memFd >= 0) {
+        close(memFd);
+    }
+    close(conn);
+    return -1;
+}
+
+int Shm_connect(int port, ShmRing* pRing) {
+    struct sockaddr_un addr;
+    socklen_t len = shmAddress(port, &addr);
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (conn < 0) {
+        return -1;
+    }
+    //the reader answers from its receive loop, which never blocks for long
+    struct timeval timeout = { 0, 200000 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(conn, (struct sockaddr *)&addr, len) < 0 || !sameUser(conn)) {
+        close(conn);
+        return -1;
+    }
+
+    int fds[2] = { -1, -1 };
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg;
+    if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+            || cmsg -> cmsg_type != SCM_RIGHTS || cmsg -> cmsg_len != CMSG_LEN(sizeof(fds))) {
+        close(conn);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    pRing -> eventFd = fds[1];
+    int mapResult = mapRing(pRing, fds[0]);
+    close(fds[0]);
+    if (mapResult < 0 || pRing -> header -> magic != SHM_MAGIC || pRing -> header -> capacity != SHM_RING_SIZE) {
+        Shm_release(pRing);
+        close(conn);
+        return -1;
+    }
+    return conn;
+}
+
+bool Shm_closed(int connFd) {
+    struct pollfd pfd = { connFd, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) <= 0) {
+        return false;
+    }
+    //nothing is ever sent after the handshake, so readable means end of file
+    return (pfd.revents & (POLLHUP | POLLERR | POLLIN)) != 0;
+}
+
+bool Shm_is_local(const struct sockaddr* addr) {
+    if (addr -> sa_family == AF_INET) {
+        const struct sockaddr_in* in = (const struct sockaddr_in *)addr;
+        if ((ntohl(in -> sin_addr.s_addr) >> 24) == 127) {
+            return true;
+        }
+    } else if (addr -> sa_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6 *)addr;
+        if (IN6_IS_ADDR_LOOPBACK(&in6 -> sin6_addr)) {
+            return true;
+        }
+    } else {
+        return false;
+    }
+
+    //the host's own address on some interface counts too
+    struct ifaddrs* list;
+    if (getifaddrs(&list) < 0) {
+        return false;
+    }
+    bool local = false;
+    for (struct ifaddrs* ifa = list; ifa != NULL && !local; ifa = ifa -> ifa_next) {
+        if (ifa -> ifa_addr == NULL || ifa -> ifa_addr -> sa_family != addr -> sa_family) {
+            continue;
+        }
+        if (addr -> sa_family == AF_INET) {
+            local = ((struct sockaddr_in *)ifa -> ifa_addr) -> sin_addr.s_addr
+                    == ((const struct sockaddr_in *)addr) -> sin_addr.s_addr;
+        } else {
+            local = memcmp(&((struct sockaddr_in6 *)ifa -> ifa_addr) -> sin6_addr,
+                           &((const struct sockaddr_in6 *)addr) -> sin6_addr, sizeof(struct in6_addr)) == 0;
+        }
+    }
+    freeifaddrs(list);
+    return local;
+}
+
+void Shm_release(ShmRing* pRing) {
+    if (pRing -> header != NULL) {
+        munmap(pRing -> header, pRing -> mapped);
+        pRing -> header = NULL;
+    }
+    if (pRing -> eventFd >= 0) {
+        close(pRing -> eventFd);
+        pRing -> eventFd = -1;
+    }
+}
+
+bool ShmRing_write(ShmRing* pRing, const void* data, size_t len) {
+    ShmRingHeader* header = pRing -> header;
+    uint64_t head = atomic_load_explicit(&header -> head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&header -> tail, memory_order_acquire);
+    size_t pos = head & (SHM_RING_SIZE - 1);
+    size_t need = SHM_ALIGN(4 + len);
+    //a datagram never wraps around: if it doesn't fit before the end, skip to the start
+    size_t skip = SHM_RING_SIZE - pos < need ? SHM_RING_SIZE - pos : 0;
+    if (need > SHM_RING_SIZE / 2 || head + skip + need - tail > SHM_RING_SIZE) {
+        return false;
+    }
+    if (skip > 0) {
+        uint32_t wrap = SHM_WRAP;
+        memcpy(pRing -> data + pos, &wrap, 4);
+        pos = 0;
+    }
+    uint32_t len32 = (uint32_t)len;
+    memcpy(pRing -> data + pos, &len32, 4);
+    memcpy(pRing -> data + pos + 4, data, len);
+    atomic_store_explicit(&header -> head, head + skip + need, memory_order_release);
+
+    //pairs with the fence in ShmRing_prepare_wait: either the reader sees the new head or we
+    //see that it is going to sleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&header -> sleeping, memory_order_relaxed)
+            && atomic_exchange_explicit(&header -> sleeping, 0, memory_order_relaxed)) {
+        uint64_t one = 1;
+        if (write(pRing -> eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("Failed to wake the shared memory reader");
+        }
+    }
+    return true;
+}
+
+ssize_t ShmRing_read(ShmRing* pRing, void* buf, size_t cap) {
+    ShmRingHeader* header = pRing -> header;
+    uint64_t tail = atomic_load_explicit(&header -> tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&header -> head, memory_order_acquire);
+    //head, and everything in the ring, come from the writer: trust none of it
+    if (head - tail > SHM_RING_SIZE) {
+        return SHM_CORRUPT;
+    }
+    while (tail != head) {
+        size_t pos = tail & (SHM_RING_SIZE - 1);
+        uint32_t len;
+        memcpy(&len, pRing -> data + pos, 4);
+        if (len == SHM_WRAP) {
+            if (SHM_RING_SIZE - pos > head - tail) {
+                return SHM_CORRUPT;
+            }
+            tail += SHM_RING_SIZE - pos;
+            continue;
+        }
+        //a record is never longer than the writer accepts, never wraps and never runs past head
+        if (len > SHM_RING_SIZE / 2 || SHM_ALIGN(4 + (size_t)len) > SHM_RING_SIZE - pos
+                || SHM_ALIGN(4 + (size_t)len) > head - tail) {
+            return SHM_CORRUPT;
+        }
+        ssize_t result = len <= cap ? (ssize_t)len : -1;
+        if (result > 0) {
+            memcpy(buf, pRing -> data + pos + 4, len);
+        }
+        atomic_store_explicit(&header -> tail, tail + SHM_ALIGN(4 + len), memory_order_release);
+        return result;
+    }
+    atomic_store_explicit(&header -> tail, tail, memory_order_release);
+    return 0;
+}
+
+bool ShmRing_prepare_wait(ShmRing* pRing) {
+    ShmRingHeader* header = pRing -> header;
+    atomic_store_explicit(&header -> sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&header -> head, memory_order_relaxed)
+            != atomic_load_explicit(&header -> tail, memory_order_relaxed)) {
+        atomic_store_explicit(&header -> sleeping, 0, memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void ShmRing_finish_wait(ShmRing* pRing) {
+    uint64_t count;
+    while (read(pRing -> eventFd, &count, sizeof(count)) > 0) {
+    }
+    atomic_store_explicit(&pRing -> header -> sleeping, 0, memory_order_relaxed);
+}
@@ -0,0 +1,86 @@
+// Shared memory transport for a peer on the same host
+//
+// Each s-talk owns the ring its peer writes into. getMsgThread listens on the abstract unix
+// socket "s-talk-<port>" (same port as its UDP socket, and like it private to the network
+// namespace). Abstract sockets have no permissions, so both ends check with SO_PEERCRED that
+// the other one runs as the same user. sendMsgThread on the other side connects to it and gets back, over SCM_RIGHTS, a
+// memfd holding a fresh ring and an eventfd. After that datagrams go into the ring instead of
+// through the UDP stack; they are the same framed datagrams handleDatagram already unpacks.
+// The unix connection stays open only so either side notices when the other one goes away.
+//
+// The ring is single producer, single consumer. Every datagram is stored as a 4 byte length
+// and the bytes, padded to 8 bytes. The reader only asks to be woken through the eventfd when
+// it has found the ring empty and is about to block, so a busy stream costs no syscalls at all.
+
+#ifndef _SHM_H_
+#define _SHM_H_
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Bytes of datagrams a ring holds, same as the UDP receive buffer s-talk asks for
+#define SHM_RING_SIZE (1 << 20)
+
+// Start of the shared mapping. head and tail sit on their own cache lines so writer and
+// reader don't keep stealing each other's line.
+typedef struct ShmRingHeader_s ShmRingHeader;
+struct ShmRingHeader_s {
+    uint32_t magic;
+    uint32_t capacity;
+    _Alignas(64) atomic_uint_fast64_t head;  // bytes ever written, only the writer moves it
+    _Alignas(64) atomic_uint_fast64_t tail;  // bytes ever consumed, only the reader moves it
+    _Alignas(64) atomic_uint sleeping;       // reader found the ring empty and may be blocked
+};
+
+typedef struct ShmRing_s ShmRing;
+struct ShmRing_s {
+    ShmRingHeader* header;
+    char* data;
+    size_t mapped;
+    int eventFd; // written by the writer to wake a sleeping reader
+};
+
+// Reader side: listens for a local writer on the abstract socket for port. Returns the
+// listening socket (non-blocking) or -1.
+int Shm_listen(int port);
+
+// Accepts a pending writer, creates a fresh ring for it and hands the ring over. Returns the
+// connection (keep it to notice the writer leaving) or -1 if nobody was waiting or setup failed.
+// A writer running as another user is turned away (errno EACCES).
+int Shm_accept(int listenFd, ShmRing* pRing);
+
+// Writer side: connects to the reader on port and maps its ring. Returns the connection or -1
+// if there is no local reader (not running, not listening for shared memory, or another user's).
+int Shm_connect(int port, ShmRing* pRing);
+
+// True if the connection's other end has gone away
+bool Shm_closed(int connFd);
+
+// True if addr is one of this host's own addresses (loopback or a local interface)
+bool Shm_is_local(const struct sockaddr* addr);
+
+// Unmaps the ring and closes its eventfd
+void Shm_release(ShmRing* pRing);
+
+// Writer: copies one datagram into the ring and wakes the reader if it is asleep.
+// Returns false if there isn't room for it right now.
+bool ShmRing_write(ShmRing* pRing, const void* data, size_t len);
+
+// Reader: copies the oldest datagram into buf and returns its length, 0 if the ring is empty.
+// A datagram longer than cap is skipped and -1 returned. The ring is writable by the other
+// process, so lengths and positions are checked: if they don't add up, SHM_CORRUPT is returned
+// (and keeps being returned) and the ring must not be used any more.
+ssize_t ShmRing_read(ShmRing* pRing, void* buf, size_t cap);
+#define SHM_CORRUPT (-2)
+
+// Reader, before blocking on eventFd: announces the reader is going to sleep. Returns false
+// (and cancels the announcement) if a datagram arrived in the meantime, so it must not block.
+bool ShmRing_prepare_wait(ShmRing* pRing);
+
+// Reader, after waking up: clears the eventfd and the announcement
+void ShmRing_finish_wait(ShmRing* pRing);
+
+#endif
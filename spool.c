@@ -0,0 +1,443 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include "spool.h"
+
+//Record header: payload length and CRC32, in host byte order (a spool never leaves the machine)
+#define SPOOL_RECORD_HEADER 8
+
+#define SPOOL_CURSOR_FILE "cursor"
+
+//On disk form of the acknowledged position
+typedef struct SpoolCursor_s SpoolCursor;
+struct SpoolCursor_s {
+    uint64_t segment;
+    uint64_t offset;
+    uint64_t seq;
+    uint32_t crc;
+    uint32_t epoch; // Spool.epoch, 0 in cursors written before there was one
+};
+
+//CRC32 (IEEE 802.3), table built on first use
+static uint32_t crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void buildCrcTable(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        crcTable[i] = c;
+    }
+}
+
+static uint32_t crc32(const void* data, size_t len) {
+    const unsigned char* p = data;
+    uint32_t c = 0xffffffffu;
+    for (size_t i = 0; i < len; i++) {
+        c = crcTable[(c ^ p[i]) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xffffffffu;
+}
+
+static int openSegment(Spool* pSpool, uint64_t segment, int flags) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.seg", (unsigned long long)segment);
+    return openat(pSpool -> dirFd, name, flags | O_CLOEXEC, 0644);
+}
+
+static int addSegment(Spool* pSpool, uint64_t segment) {
+    if (pSpool -> segmentCount == pSpool -> segmentCap) {
+        int cap = pSpool -> segmentCap > 0 ? pSpool -> segmentCap * 2 : 16;
+        uint64_t* segments = realloc(pSpool -> segments, sizeof(uint64_t) * cap);
+        if (segments == NULL) {
+            return -1;
+        }
+        pSpool -> segments = segments;
+        pSpool -> segmentCap = cap;
+    }
+    pSpool -> segments[pSpool -> segmentCount++] = segment;
+    return 0;
+}
+
+static int compareSegments(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+//Finds the segment files in the directory, oldest first, creating the first one if there are none
+static int listSegments(Spool* pSpool) {
+    int fd = dup(pSpool -> dirFd);
+    DIR* dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char* end;
+        uint64_t segment = strtoull(entry -> d_name, &end, 16);
+        if (end == entry -> d_name + 16 && strcmp(end, ".seg") == 0 && addSegment(pSpool, segment) < 0) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+    qsort(pSpool -> segments, pSpool -> segmentCount, sizeof(uint64_t), compareSegments);
+
+    if (pSpool -> segmentCount == 0) {
+        int segmentFd = openSegment(pSpool, 0, O_RDWR | O_CREAT);
+        if (segmentFd < 0 || fsync(pSpool -> dirFd) < 0 || addSegment(pSpool, 0) < 0) {
+            return -1;
+        }
+        close(segmentFd);
+    }
+    return 0;
+}
+
+//Scans the newest segment and cuts it off after the last complete, intact record. Older
+//segments were synced before it was created and are trusted as they are.
+static int recoverTail(Spool* pSpool) {
+    uint64_t segment = pSpool -> segments[pSpool -> segmentCount - 1];
+    pSpool -> writeFd = openSegment(pSpool, segment, O_RDWR);
+    struct stat st;
+    if (pSpool -> writeFd < 0 || fstat(pSpool -> writeFd, &st) < 0) {
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    char* data = malloc(size > 0 ? size : 1);
+    if (data == NULL) {
+        return -1;
+    }
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = pread(pSpool -> writeFd, data + got, size - got, got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+
+    size_t off = 0;
+    uint64_t records = 0;
+    while (off + SPOOL_RECORD_HEADER <= got) {
+        uint32_t header[2];
+        memcpy(header, data + off, sizeof(header));
+        if (header[0] == 0 || header[0] > SPOOL_MAX_RECORD || off + SPOOL_RECORD_HEADER + header[0] > got
+                || crc32(data + off + SPOOL_RECORD_HEADER, header[0]) != header[1]) {
+            break;
+        }
+        off += SPOOL_RECORD_HEADER + header[0];
+        records++;
+    }
+    free(data);
+
+    if (off < size) {
+        pSpool -> recoveredBytes = size - off;
+        if (ftruncate(pSpool -> writeFd, off) < 0 || fdatasync(pSpool -> writeFd) < 0) {
+            return -1;
+        }
+    }
+    pSpool -> writeSegment = segment;
+    pSpool -> writeSize = off;
+    pSpool -> nextSeq = segment + records;
+    pSpool -> durableSeq = pSpool -> nextSeq;
+    return 0;
+}
+
+//Deletes the segments that lie entirely behind the acknowledged position. Called with lock held.
+static void dropOldSegments(Spool* pSpool) {
+    int drop = 0;
+    while (drop < pSpool -> segmentCount - 1 && pSpool -> segments[drop] < pSpool -> acked.segment) {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.seg", (unsigned long long)pSpool -> segments[drop]);
+        unlinkat(pSpool -> dirFd, name, 0);
+        drop++;
+    }
+    if (drop > 0) {
+        pSpool -> segmentCount -= drop;
+        memmove(pSpool -> segments, pSpool -> segments + drop, sizeof(uint64_t) * pSpool -> segmentCount);
+    }
+}
+
+static bool haveSegment(Spool* pSpool, uint64_t segment) {
+    for (int i = 0; i < pSpool -> segmentCount; i++) {
+        if (pSpool -> segments[i] == segment) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Not synced: losing the cursor in a crash only means some records are delivered twice
+static int writeCursor(Spool* pSpool, const SpoolPos* pPos) {
+    SpoolCursor cursor = { pPos -> segment, pPos -> offset, pPos -> seq, 0, pSpool -> epoch };
+    cursor.crc = crc32(&cursor, offsetof(SpoolCursor, crc));
+    return pwrite(pSpool -> cursorFd, &cursor, sizeof(cursor), 0) == sizeof(cursor) ? 0 : -1;
+}
+
+//Picks up the acknowledged position. A missing or damaged cursor falls back to the start of the
+//oldest segment: already delivered records may go out again, but none are skipped.
+static int loadCursor(Spool* pSpool) {
+    pSpool -> cursorFd = openat(pSpool -> dirFd, SPOOL_CURSOR_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (pSpool -> cursorFd < 0) {
+        return -1;
+    }
+    SpoolCursor cursor;
+    bool valid = pread(pSpool -> cursorFd, &cursor, sizeof(cursor), 0) == sizeof(cursor)
+            && crc32(&cursor, offsetof(SpoolCursor, crc)) == cursor.crc
+            && haveSegment(pSpool, cursor.segment)
+            && cursor.seq >= cursor.segment && cursor.seq <= pSpool -> nextSeq
+            && (cursor.segment != pSpool -> writeSegment || cursor.offset <= pSpool -> writeSize);
+    if (valid) {
+        pSpool -> acked = (SpoolPos){ cursor.segment, cursor.offset, cursor.seq };
+    } else {
+        pSpool -> acked = (SpoolPos){ pSpool -> segments[0], 0, pSpool -> segments[0] };
+    }
+    //without a cursor we can't tell whether the numbering started over, so start a new epoch
+    //(one too many only costs the reader some duplicates) and keep it from now on
+    pSpool -> epoch = valid ? cursor.epoch : 0;
+    if (pSpool -> epoch == 0) {
+        if (getrandom(&pSpool -> epoch, sizeof(pSpool -> epoch), 0) != sizeof(pSpool -> epoch)) {
+            pSpool -> epoch = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+        }
+        pSpool -> epoch |= 1;
+        if (writeCursor(pSpool, &pSpool -> acked) < 0) {
+            return -1;
+        }
+    }
+    dropOldSegments(pSpool);
+
+    pSpool -> read = pSpool -> acked;
+    pSpool -> readFd = openSegment(pSpool, pSpool -> read.segment, O_RDONLY);
+    return pSpool -> readFd < 0 ? -1 : 0;
+}
+
+static void closeFiles(Spool* pSpool) {
+    int* fds[] = { &pSpool -> writeFd, &pSpool -> readFd, &pSpool -> cursorFd, &pSpool -> dirFd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+    free(pSpool -> buffer);
+    free(pSpool -> segments);
+    pSpool -> buffer = NULL;
+    pSpool -> segments = NULL;
+}
+
+int Spool_open(Spool* pSpool, const char* path) {
+    pthread_once(&crcOnce, buildCrcTable);
+    memset(pSpool, 0, sizeof(*pSpool));
+    pSpool -> dirFd = pSpool -> cursorFd = pSpool -> writeFd = pSpool -> readFd = -1;
+    pthread_mutex_init(&pSpool -> lock, NULL);
+    pthread_cond_init(&pSpool -> ready, NULL);
+
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    pSpool -> dirFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    pSpool -> buffer = malloc(SPOOL_WRITE_BUFFER);
+    if (pSpool -> dirFd < 0 || pSpool -> buffer == NULL
+            || listSegments(pSpool) < 0 || recoverTail(pSpool) < 0 || loadCursor(pSpool) < 0) {
+        int saved = errno;
+        closeFiles(pSpool);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+//Writes the buffered records to the end of the newest segment
+static int flushBuffer(Spool* pSpool) {
+    size_t done = 0;
+    off_t base = (off_t)(pSpool -> writeSize - pSpool -> buffered);
+    while (done < pSpool -> buffered) {
+        ssize_t n = pwrite(pSpool -> writeFd, pSpool -> buffer + done, pSpool -> buffered - done, base + done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    pSpool -> buffered = 0;
+    return 0;
+}
+
+//Lets the reader see everything appended so far. Only call once it is on disk.
+static void publish(Spool* pSpool) {
+    pthread_mutex_lock(&pSpool -> lock);
+    pSpool -> durableSeq = pSpool -> nextSeq;
+    pthread_cond_broadcast(&pSpool -> ready);
+    pthread_mutex_unlock(&pSpool -> lock);
+}
+
+//Seals the newest segment and starts the next one, named after the next sequence number
+static int rollSegment(Spool* pSpool) {
+    if (flushBuffer(pSpool) < 0 || fdatasync(pSpool -> writeFd) < 0) {
+        return -1;
+    }
+    pSpool -> syncs++;
+    publish(pSpool);
+
+    int fd = openSegment(pSpool, pSpool -> nextSeq, O_RDWR | O_CREAT | O_TRUNC);
+    if (fd < 0 || fsync(pSpool -> dirFd) < 0) {
+        return -1;
+    }
+    close(pSpool -> writeFd);
+    pSpool -> writeFd = fd;
+    pSpool -> writeSegment = pSpool -> nextSeq;
+    pSpool -> writeSize = 0;
+
+    pthread_mutex_lock(&pSpool -> lock);
+    int result = addSegment(pSpool, pSpool -> writeSegment);
+    pthread_mutex_unlock(&pSpool -> lock);
+    return result;
+}
+
+int Spool_append(Spool* pSpool, const void* data, uint32_t len) {
+    if (len == 0 || len > SPOOL_MAX_RECORD) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pSpool -> writeSize >= SPOOL_SEGMENT_SIZE && rollSegment(pSpool) < 0) {
+        return -1;
+    }
+    if (pSpool -> buffered + SPOOL_RECORD_HEADER + len > SPOOL_WRITE_BUFFER && flushBuffer(pSpool) < 0) {
+        return -1;
+    }
+    uint32_t header[2] = { len, crc32(data, len) };
+    memcpy(pSpool -> buffer + pSpool -> buffered, header, sizeof(header));
+    memcpy(pSpool -> buffer + pSpool -> buffered + SPOOL_RECORD_HEADER, data, len);
+    pSpool -> buffered += SPOOL_RECORD_HEADER + len;
+    pSpool -> writeSize += SPOOL_RECORD_HEADER + len;
+    pSpool -> nextSeq++;
+    return 0;
+}
+
+int Spool_sync(Spool* pSpool) {
+    //durableSeq is only ever changed by the writer, so it can be read here without the lock
+    if (pSpool -> durableSeq == pSpool -> nextSeq) {
+        return 0;
+    }
+    if (flushBuffer(pSpool) < 0 || fdatasync(pSpool -> writeFd) < 0) {
+        return -1;
+    }
+    pSpool -> syncs++;
+    publish(pSpool);
+    return 0;
+}
+
+ssize_t Spool_read(Spool* pSpool, void* buf, size_t cap) {
+    pthread_mutex_lock(&pSpool -> lock);
+    uint64_t durable = pSpool -> durableSeq;
+    pthread_mutex_unlock(&pSpool -> lock);
+    if (pSpool -> read.seq >= durable) {
+        return 0;
+    }
+
+    uint32_t header[2];
+    ssize_t n = pread(pSpool -> readFd, header, sizeof(header), pSpool -> read.offset);
+    if (n == 0) {
+        //end of this segment: the next record is the first of the segment named after it
+        int fd = openSegment(pSpool, pSpool -> read.seq, O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        close(pSpool -> readFd);
+        pSpool -> readFd = fd;
+        pSpool -> read.segment = pSpool -> read.seq;
+        pSpool -> read.offset = 0;
+        n = pread(pSpool -> readFd, header, sizeof(header), 0);
+    }
+    if (n != sizeof(header) || header[0] > cap) {
+        errno = n < 0 ? errno : (n != sizeof(header) ? EIO : EMSGSIZE);
+        return -1;
+    }
+    if (pread(pSpool -> readFd, buf, header[0], pSpool -> read.offset + SPOOL_RECORD_HEADER) != header[0]
+            || crc32(buf, header[0]) != header[1]) {
+        errno = EIO;
+        return -1;
+    }
+    pSpool -> read.offset += SPOOL_RECORD_HEADER + header[0];
+    pSpool -> read.seq++;
+    return header[0];
+}
+
+void Spool_wait(Spool* pSpool, const struct timespec* deadline) {
+    pthread_mutex_lock(&pSpool -> lock);
+    while (pSpool -> read.seq >= pSpool -> durableSeq && !pSpool -> woken) {
+        if (pthread_cond_timedwait(&pSpool -> ready, &pSpool -> lock, deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pSpool -> lock);
+}
+
+void Spool_wake(Spool* pSpool) {
+    pthread_mutex_lock(&pSpool -> lock);
+    pSpool -> woken = true;
+    pthread_cond_broadcast(&pSpool -> ready);
+    pthread_mutex_unlock(&pSpool -> lock);
+}
+
+int Spool_ack(Spool* pSpool) {
+    return Spool_ack_to(pSpool, &pSpool -> read);
+}
+
+int Spool_ack_to(Spool* pSpool, const SpoolPos* pPos) {
+    if (pSpool -> acked.seq == pPos -> seq) {
+        return 0;
+    }
+    if (writeCursor(pSpool, pPos) < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&pSpool -> lock);
+    pSpool -> acked = *pPos;
+    dropOldSegments(pSpool);
+    pthread_mutex_unlock(&pSpool -> lock);
+    return 0;
+}
+
+void Spool_rewind(Spool* pSpool) {
+    if (pSpool -> read.segment != pSpool -> acked.segment) {
+        int fd = openSegment(pSpool, pSpool -> acked.segment, O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        close(pSpool -> readFd);
+        pSpool -> readFd = fd;
+    }
+    pSpool -> read = pSpool -> acked;
+}
+
+uint64_t Spool_pending(Spool* pSpool) {
+    pthread_mutex_lock(&pSpool -> lock);
+    uint64_t pending = pSpool -> durableSeq - pSpool -> acked.seq;
+    pthread_mutex_unlock(&pSpool -> lock);
+    return pending;
+}
+
+void Spool_close(Spool* pSpool) {
+    if (pSpool -> writeFd >= 0) {
+        Spool_sync(pSpool);
+    }
+    closeFiles(pSpool);
+    pthread_mutex_destroy(&pSpool -> lock);
+    pthread_cond_destroy(&pSpool -> ready);
+}
@@ -0,0 +1,111 @@
+// Disk-backed FIFO of records, used by s-talk-relay to hold chat lines for a peer that is offline
+//
+// A spool is a directory of append-only segment files, each named after the sequence number of
+// its first record (0000000000000000.seg, ...). A record is a 4 byte length, a 4 byte CRC32 of
+// the payload and the payload itself. Appends are buffered and go to the newest segment; once it
+// passes SPOOL_SEGMENT_SIZE it is synced and the next one is started. Spool_sync makes everything
+// appended so far durable with a single fdatasync (group commit) and only then lets the reader
+// see it, so nothing is ever handed out that could be lost in a crash.
+//
+// The reader's position is kept in a small "cursor" file, written when Spool_ack confirms
+// delivery; segments entirely behind it are deleted. Until then Spool_rewind can go back and
+// hand the same records out again. The cursor file also keeps the spool's epoch, a random number
+// picked when there is no cursor to go by (a new or wiped spool), so whoever sees the sequence
+// numbers can tell when they start over.
+//
+// Recovery: a segment is synced before the next one is created, so on open only the newest
+// segment has to be checked. It is scanned record by record and cut off at the first short or
+// corrupt record, which keeps restart time bounded by the segment size instead of the backlog.
+//
+// One thread may append and sync while another reads and acks.
+
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define SPOOL_SEGMENT_SIZE (8 << 20)
+#define SPOOL_MAX_RECORD 65536
+#define SPOOL_WRITE_BUFFER (256 << 10)
+
+// Where a reader is: the segment it is in, the byte offset in it and the record's sequence number
+typedef struct SpoolPos_s SpoolPos;
+struct SpoolPos_s {
+    uint64_t segment;
+    uint64_t offset;
+    uint64_t seq;
+};
+
+typedef struct Spool_s Spool;
+struct Spool_s {
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // signalled when Spool_sync makes new records readable
+    int dirFd;
+    int cursorFd;
+
+    // writer side
+    int writeFd;
+    uint64_t writeSegment;
+    uint64_t writeSize; // bytes in the newest segment, including the buffered ones
+    uint64_t nextSeq;   // sequence number the next append gets
+    char* buffer;
+    size_t buffered;
+
+    // shared, under lock
+    uint64_t durableSeq; // records below this are on disk and may be read
+    uint64_t* segments;  // first sequence number of every segment on disk, oldest first
+    int segmentCount;
+    int segmentCap;
+
+    // reader side
+    int readFd;
+    SpoolPos read;  // next record to hand out
+    SpoolPos acked; // next record not yet confirmed as delivered
+    uint32_t epoch; // nonzero, changes whenever the numbering may have started over
+
+    bool woken; // Spool_wake was called, Spool_wait returns at once
+
+    uint64_t syncs;
+    uint64_t recoveredBytes; // tail of the newest segment cut off during recovery
+};
+
+// Opens (or creates) the spool in directory path and recovers it. Returns 0 on success, -1 on
+// failure with errno set.
+int Spool_open(Spool* pSpool, const char* path);
+
+// Appends one record. It is not durable, or visible to the reader, until the next Spool_sync.
+int Spool_append(Spool* pSpool, const void* data, uint32_t len);
+
+// Writes out and fdatasyncs everything appended since the last sync, then wakes the reader
+int Spool_sync(Spool* pSpool);
+
+// Copies the next unread record into buf. Returns its length, 0 if there is nothing new, -1 on
+// an I/O error or a record that is corrupt or larger than cap.
+ssize_t Spool_read(Spool* pSpool, void* buf, size_t cap);
+
+// Waits until there is something to read, the CLOCK_REALTIME deadline passes or Spool_wake is called
+void Spool_wait(Spool* pSpool, const struct timespec* deadline);
+
+// Wakes the reader out of Spool_wait for good (used when shutting down)
+void Spool_wake(Spool* pSpool);
+
+// Confirms everything read so far as delivered and deletes segments that are no longer needed
+int Spool_ack(Spool* pSpool);
+
+// Like Spool_ack, but only confirms the records before pPos, a copy of read taken since the
+// last ack or rewind (for a reader that has read a record it hasn't delivered yet)
+int Spool_ack_to(Spool* pSpool, const SpoolPos* pPos);
+
+// Goes back to the first record that hasn't been confirmed, to hand it out again
+void Spool_rewind(Spool* pSpool);
+
+// Durable records that haven't been confirmed yet
+uint64_t Spool_pending(Spool* pSpool);
+
+// Syncs anything outstanding and closes the spool
+void Spool_close(Spool* pSpool);
+
+#endif
@@ -0,0 +1,145 @@
+#include "stats.h"
+
+Stats stats;
+
+//nanoseconds to milliseconds for display
+static double ms(uint64_t ns) {
+    return (double)ns / 1e6;
+}
+
+void Hist_record(Hist* pHist, uint64_t ns) {
+    //bucket = index of the highest set bit, samples below 1ns land in bucket 0
+    int bucket = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= HIST_BUCKETS) {
+        bucket = HIST_BUCKETS - 1;
+    }
+    atomic_fetch_add_explicit(&pHist -> buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pHist -> count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pHist -> sumNs, ns, memory_order_relaxed);
+    uint_fast64_t max = atomic_load_explicit(&pHist -> maxNs, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&pHist -> maxNs, &max, ns,
+                                                              memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+uint64_t Hist_percentile(Hist* pHist, double p) {
+    uint64_t count = atomic_load_explicit(&pHist -> count, memory_order_relaxed);
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&pHist -> buckets[i], memory_order_relaxed);
+        if (seen >= rank) {
+            return 2ull << i;
+        }
+    }
+    return atomic_load_explicit(&pHist -> maxNs, memory_order_relaxed);
+}
+
+//formats a nanosecond value with a unit that keeps it short
+static void formatNs(char* out, size_t size, uint64_t ns) {
+    if (ns < 1000) {
+        snprintf(out, size, "%lluns", (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        snprintf(out, size, "%.1fus", (double)ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(out, size, "%.1fms", (double)ns / 1e6);
+    } else {
+        snprintf(out, size, "%.1fs", (double)ns / 1e9);
+    }
+}
+
+void Hist_print(FILE* out, const char* name, Hist* pHist) {
+    uint64_t count = atomic_load_explicit(&pHist -> count, memory_order_relaxed);
+    if (count == 0) {
+        fprintf(out, "%s: no samples\n", name);
+        return;
+    }
+    char p50[16], p99[16], p999[16], mean[16], max[16];
+    formatNs(p50, sizeof(p50), Hist_percentile(pHist, 50));
+    formatNs(p99, sizeof(p99), Hist_percentile(pHist, 99));
+    formatNs(p999, sizeof(p999), Hist_percentile(pHist, 99.9));
+    formatNs(mean, sizeof(mean), atomic_load_explicit(&pHist -> sumNs, memory_order_relaxed) / count);
+    formatNs(max, sizeof(max), atomic_load_explicit(&pHist -> maxNs, memory_order_relaxed));
+    fprintf(out, "%s: %llu samples, mean %s, p50 <%s, p99 <%s, p99.9 <%s, max %s\n", name,
+            (unsigned long long)count, mean, p50, p99, p999, max);
+
+    //one bar per bucket, scaled so the fullest bucket is 40 characters wide
+    uint64_t fullest = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t n = atomic_load_explicit(&pHist -> buckets[i], memory_order_relaxed);
+        if (n > fullest) {
+            fullest = n;
+        }
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t n = atomic_load_explicit(&pHist -> buckets[i], memory_order_relaxed);
+        if (n == 0) {
+            continue;
+        }
+        char upper[16];
+        formatNs(upper, sizeof(upper), 2ull << i);
+        int width = (int)((n * 40 + fullest - 1) / fullest);
+        fprintf(out, "  <%-8s %9llu %.*s\n", upper, (unsigned long long)n, width,
+                "########################################");
+    }
+}
+
+void Stats_print(FILE* out, Peer* pPeer, bool legacyPeer) {
+    PeerStats peer;
+    Peer_snapshot(pPeer, Proto_now_ns(), &peer);
+
+    fprintf(out, "---- s-talk stats ----\n");
+    fprintf(out, "sent:     %llu messages, %llu bytes, %llu datagrams\n",
+            (unsigned long long)STATS_GET(msgsSent), (unsigned long long)STATS_GET(bytesSent),
+            (unsigned long long)STATS_GET(datagramsSent));
+    fprintf(out, "received: %llu messages, %llu bytes, %llu datagrams (%llu malformed, %llu screen stalls, %llu duplicates, %llu early)\n",
+            (unsigned long long)STATS_GET(msgsReceived), (unsigned long long)STATS_GET(bytesReceived),
+            (unsigned long long)STATS_GET(datagramsReceived), (unsigned long long)STATS_GET(malformed),
+            (unsigned long long)STATS_GET(receiveStalls), (unsigned long long)STATS_GET(duplicates),
+            (unsigned long long)STATS_GET(early));
+    uint64_t datagramsSent = STATS_GET(datagramsSent);
+    uint64_t datagramsReceived = STATS_GET(datagramsReceived);
+    fprintf(out, "packing:  %.2f records per datagram sent, %.2f received; %llu coalescing waits gained %llu messages\n",
+            datagramsSent > 0 ? (double)STATS_GET(recordsSent) / datagramsSent : 0.0,
+            datagramsReceived > 0 ? (double)STATS_GET(recordsReceived) / datagramsReceived : 0.0,
+            (unsigned long long)STATS_GET(coalesceWaits), (unsigned long long)STATS_GET(coalescedMessages));
+    if (STATS_GET(shmSent) + STATS_GET(shmReceived) > 0) {
+        fprintf(out, "shm:      %llu datagrams sent, %llu received through shared memory; %llu wakeups, %llu full waits, %llu probe datagrams sent over UDP past them\n",
+                (unsigned long long)STATS_GET(shmSent), (unsigned long long)STATS_GET(shmReceived),
+                (unsigned long long)STATS_GET(shmWakeups), (unsigned long long)STATS_GET(shmFullWaits),
+                (unsigned long long)STATS_GET(shmProbesAhead));
+    }
+    uint64_t msgs = STATS_GET(msgsSent) + STATS_GET(msgsReceived);
+    fprintf(out, "syscalls: %llu socket/io_uring calls (%.2f per message)\n",
+            (unsigned long long)STATS_GET(ioSyscalls), msgs > 0 ? (double)STATS_GET(ioSyscalls) / msgs : 0.0);
+    const char* liveness = legacyPeer ? "unknown (legacy peer)" : (peer.alive ? "alive" : "not responding");
+    fprintf(out, "peer:     %s, last heard %.1f ms ago\n", liveness, ms(peer.sinceHeardNs));
+    if (peer.samples == 0) {
+        fprintf(out, "rtt:      no samples yet (%u probes sent)\n", peer.probesSent);
+    } else {
+        fprintf(out, "rtt:      srtt %.3f ms, rttvar %.3f ms, min %.3f ms, jitter %.3f ms, rto %.1f ms\n",
+                ms(peer.srttNs), ms(peer.rttvarNs), ms(peer.minRttNs), ms(peer.jitterNs), ms(peer.rtoNs));
+        fprintf(out, "probes:   %u sent, %u answered by peer, %llu answered by us\n",
+                peer.probesSent, peer.samples, (unsigned long long)STATS_GET(pingsAnswered));
+    }
+    Hist_print(out, "send queue wait", &stats.sendQueue);
+    Hist_print(out, "receive queue wait", &stats.receiveQueue);
+
+    if (STATS_GET(tracedReceived) > 0) {
+        fprintf(out, "trace:    %llu traced messages received, %llu id gaps, %llu clock skewed samples\n",
+                (unsigned long long)STATS_GET(tracedReceived), (unsigned long long)STATS_GET(traceGaps),
+                (unsigned long long)STATS_GET(traceClockSkew));
+        Hist_print(out, "  send queue (peer typed -> peer send)", &stats.traceSendQueue);
+        Hist_print(out, "  network (peer send -> kernel rx)", &stats.traceNetwork);
+        Hist_print(out, "  socket (kernel rx -> getMsgThread)", &stats.traceSocket);
+        Hist_print(out, "  queue (receiveList)", &stats.traceQueue);
+        Hist_print(out, "  terminal (dequeue -> printed)", &stats.traceTerminal);
+        Hist_print(out, "  total (peer typed -> printed)", &stats.traceTotal);
+    }
+}
@@ -0,0 +1,80 @@
+// Runtime counters and latency histograms for s-talk
+//
+// Counters are bumped from every thread without taking a lock, so they are relaxed atomics.
+// Stats_print is what the "!stats" command and the exit path show.
+
+#ifndef _STATS_H_
+#define _STATS_H_
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "peer.h"
+
+// Log2 latency histogram: bucket i counts samples in [2^i, 2^(i+1)) nanoseconds
+#define HIST_BUCKETS 40
+
+typedef struct Hist_s Hist;
+struct Hist_s {
+    atomic_uint_fast64_t buckets[HIST_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sumNs;
+    atomic_uint_fast64_t maxNs;
+};
+
+// Adds one sample to pHist
+void Hist_record(Hist* pHist, uint64_t ns);
+
+// Upper bound of the bucket holding the p-th percentile (0 < p <= 100), 0 if empty
+uint64_t Hist_percentile(Hist* pHist, double p);
+
+// Prints a one line summary followed by a bar per non-empty bucket
+void Hist_print(FILE* out, const char* name, Hist* pHist);
+
+typedef struct Stats_s Stats;
+struct Stats_s {
+    atomic_uint_fast64_t msgsSent;
+    atomic_uint_fast64_t msgsReceived;
+    atomic_uint_fast64_t bytesSent;
+    atomic_uint_fast64_t bytesReceived;
+    atomic_uint_fast64_t datagramsSent;
+    atomic_uint_fast64_t datagramsReceived;
+    atomic_uint_fast64_t pingsAnswered;
+    atomic_uint_fast64_t malformed;
+    atomic_uint_fast64_t receiveStalls; // times getMsgThread waited for screenOutputThread to make room
+    atomic_uint_fast64_t duplicates;    // lines a relay delivered again that were already shown
+    atomic_uint_fast64_t early;         // relayed lines dropped for coming ahead of a missing one
+    atomic_uint_fast64_t ioSyscalls; // sendto/recvfrom/io_uring_enter made for messages
+    atomic_uint_fast64_t recordsSent;       // records packed into datagramsSent (chat, control, probes)
+    atomic_uint_fast64_t recordsReceived;   // records unpacked from datagramsReceived
+    atomic_uint_fast64_t coalesceWaits;     // times sendMsgThread held a datagram back for a backlog
+    atomic_uint_fast64_t coalescedMessages; // messages that arrived during those waits
+    atomic_uint_fast64_t shmSent;           // datagramsSent that went through the peer's shared memory ring
+    atomic_uint_fast64_t shmReceived;       // datagramsReceived that came through our shared memory ring
+    atomic_uint_fast64_t shmWakeups;        // times getMsgThread slept until the ring's eventfd woke it
+    atomic_uint_fast64_t shmFullWaits;      // times sendMsgThread found the peer's ring full and backed off
+    atomic_uint_fast64_t shmProbesAhead;    // datagrams of PINGs/PONGs sent over UDP past a full ring
+    Hist sendQueue;    // time from entering sendList to being picked up by sendMsgThread
+    Hist receiveQueue; // time from entering receiveList to being picked up by screenOutputThread
+
+    // end-to-end tracing of messages the peer sent with -T, broken down by stage
+    atomic_uint_fast64_t tracedReceived;
+    atomic_uint_fast64_t traceGaps;      // trace ids that skipped ahead or went backwards (loss/reorder)
+    atomic_uint_fast64_t traceClockSkew; // samples dropped because the peer's clock is ahead of ours
+    Hist traceSendQueue; // peer's keypress -> peer's send timestamp (its sendList and coalescing)
+    Hist traceNetwork;  // peer's send timestamp -> our kernel receive timestamp
+    Hist traceSocket;   // kernel receive -> getMsgThread has the datagram
+    Hist traceQueue;    // receiveList entry -> receiveList exit
+    Hist traceTerminal; // receiveList exit -> written to the terminal
+    Hist traceTotal;    // peer's keypress -> written to the terminal
+};
+
+extern Stats stats;
+
+#define STATS_ADD(field, n) atomic_fetch_add_explicit(&stats.field, (n), memory_order_relaxed)
+#define STATS_GET(field) atomic_load_explicit(&stats.field, memory_order_relaxed)
+
+// Prints all counters and the peer's RTT/liveness estimates to out. A legacy peer is never
+// probed, so its liveness is shown as unknown.
+void Stats_print(FILE* out, Peer* pPeer, bool legacyPeer);
+
+#endif
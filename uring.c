@@ -0,0 +1,240 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+//glibc has no wrappers for the io_uring syscalls
+static int sysSetup(unsigned entries, struct io_uring_params* pParams) {
+    return (int)syscall(__NR_io_uring_setup, entries, pParams);
+}
+
+static int sysEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int sysRegister(int fd, unsigned opcode, void* arg, unsigned nrArgs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+int Uring_init(Uring* pRing, unsigned entries) {
+    struct io_uring_params params;
+    memset(pRing, 0, sizeof(*pRing));
+    memset(&params, 0, sizeof(params));
+    pRing -> fd = -1;
+
+    int fd = sysSetup(entries, &params);
+    if (fd < 0) {
+        return -1;
+    }
+    pRing -> fd = fd;
+
+    //map the submission ring, completion ring and the array of submission entries
+    pRing -> sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    pRing -> cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    pRing -> sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    pRing -> sqRing = mmap(NULL, pRing -> sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           fd, IORING_OFF_SQ_RING);
+    pRing -> cqRing = mmap(NULL, pRing -> cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           fd, IORING_OFF_CQ_RING);
+    pRing -> sqes = mmap(NULL, pRing -> sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_SQES);
+    if (pRing -> sqRing == MAP_FAILED || pRing -> cqRing == MAP_FAILED || pRing -> sqes == MAP_FAILED) {
+        int saved = errno;
+        Uring_exit(pRing);
+        errno = saved;
+        return -1;
+    }
+
+    char* sq = pRing -> sqRing;
+    pRing -> sqHead = (unsigned *)(sq + params.sq_off.head);
+    pRing -> sqTail = (unsigned *)(sq + params.sq_off.tail);
+    pRing -> sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    pRing -> sqArray = (unsigned *)(sq + params.sq_off.array);
+
+    char* cq = pRing -> cqRing;
+    pRing -> cqHead = (unsigned *)(cq + params.cq_off.head);
+    pRing -> cqTail = (unsigned *)(cq + params.cq_off.tail);
+    pRing -> cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    pRing -> cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    //identity mapping from array slots to sqes, set once so submission only bumps the tail
+    for (unsigned i = 0; i <= pRing -> sqMask; i++) {
+        pRing -> sqArray[i] = i;
+    }
+    return 0;
+}
+
+void Uring_exit(Uring* pRing) {
+    if (pRing -> bufRing != NULL) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = pRing -> bufGroup;
+        sysRegister(pRing -> fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(pRing -> bufRing, pRing -> bufRingSize);
+        munmap(pRing -> bufBase, (size_t)pRing -> bufCount * pRing -> bufSize);
+    }
+    if (pRing -> sqes != NULL && pRing -> sqes != MAP_FAILED) {
+        munmap(pRing -> sqes, pRing -> sqesSize);
+    }
+    if (pRing -> cqRing != NULL && pRing -> cqRing != MAP_FAILED) {
+        munmap(pRing -> cqRing, pRing -> cqRingSize);
+    }
+    if (pRing -> sqRing != NULL && pRing -> sqRing != MAP_FAILED) {
+        munmap(pRing -> sqRing, pRing -> sqRingSize);
+    }
+    if (pRing -> fd >= 0) {
+        close(pRing -> fd);
+    }
+    memset(pRing, 0, sizeof(*pRing));
+    pRing -> fd = -1;
+}
+
+struct io_uring_sqe* Uring_get_sqe(Uring* pRing) {
+    unsigned head = __atomic_load_n(pRing -> sqHead, __ATOMIC_ACQUIRE);
+    unsigned tail = *pRing -> sqTail + pRing -> sqPending;
+    if (tail - head > pRing -> sqMask) {
+        return NULL;
+    }
+    struct io_uring_sqe* sqe = &pRing -> sqes[tail & pRing -> sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    pRing -> sqPending++;
+    return sqe;
+}
+
+int Uring_submit(Uring* pRing, unsigned waitNr) {
+    unsigned toSubmit = pRing -> sqPending;
+    //publish the new tail so the kernel sees every prepared sqe
+    __atomic_store_n(pRing -> sqTail, *pRing -> sqTail + toSubmit, __ATOMIC_RELEASE);
+    pRing -> sqPending = 0;
+
+    int ret;
+    do {
+        ret = sysEnter(pRing -> fd, toSubmit, waitNr, waitNr > 0 ? IORING_ENTER_GETEVENTS : 0);
+        pRing -> enterCalls++;
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+struct io_uring_cqe* Uring_peek_cqe(Uring* pRing) {
+    unsigned head = *pRing -> cqHead;
+    unsigned tail = __atomic_load_n(pRing -> cqTail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return &pRing -> cqes[head & pRing -> cqMask];
+}
+
+void Uring_cqe_seen(Uring* pRing) {
+    __atomic_store_n(pRing -> cqHead, *pRing -> cqHead + 1, __ATOMIC_RELEASE);
+}
+
+int Uring_setup_buffers(Uring* pRing, unsigned count, unsigned size, uint16_t group) {
+    //the ring itself must be page aligned, so it gets its own anonymous mapping
+    size_t ringSize = count * sizeof(struct io_uring_buf);
+    void* ring = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return -1;
+    }
+    void* base = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        munmap(ring, ringSize);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (sysRegister(pRing -> fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int saved = errno;
+        munmap(ring, ringSize);
+        munmap(base, (size_t)count * size);
+        errno = saved;
+        return -1;
+    }
+
+    pRing -> bufRing = ring;
+    pRing -> bufRingSize = ringSize;
+    pRing -> bufBase = base;
+    pRing -> bufCount = count;
+    pRing -> bufSize = size;
+    pRing -> bufGroup = group;
+
+    //hand every buffer to the kernel
+    for (unsigned i = 0; i < count; i++) {
+        Uring_recycle_buffer(pRing, i);
+    }
+    return 0;
+}
+
+char* Uring_buffer(Uring* pRing, unsigned id) {
+    return pRing -> bufBase + (size_t)id * pRing -> bufSize;
+}
+
+void Uring_recycle_buffer(Uring* pRing, unsigned id) {
+    struct io_uring_buf_ring* ring = pRing -> bufRing;
+    unsigned short tail = ring -> tail;
+    struct io_uring_buf* buf = &ring -> bufs[tail & (pRing -> bufCount - 1)];
+    buf -> addr = (uint64_t)(uintptr_t)Uring_buffer(pRing, id);
+    buf -> len = pRing -> bufSize;
+    buf -> bid = (uint16_t)id;
+    __atomic_store_n(&ring -> tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+void Uring_prep_sendmsg(struct io_uring_sqe* pSqe, int fd, const struct msghdr* pMsg, uint64_t userData) {
+    pSqe -> opcode = IORING_OP_SENDMSG;
+    pSqe -> fd = fd;
+    pSqe -> addr = (uint64_t)(uintptr_t)pMsg;
+    pSqe -> len = 1;
+    pSqe -> user_data = userData;
+}
+
+void Uring_prep_writev(struct io_uring_sqe* pSqe, int fd, const struct iovec* pIov, unsigned count, uint64_t userData) {
+    pSqe -> opcode = IORING_OP_WRITEV;
+    pSqe -> fd = fd;
+    pSqe -> addr = (uint64_t)(uintptr_t)pIov;
+    pSqe -> len = count;
+    pSqe -> off = (uint64_t)-1; //use (and advance) the current file position like write(2)
+    pSqe -> user_data = userData;
+}
+
+void Uring_prep_recvmsg_multishot(struct io_uring_sqe* pSqe, int fd, struct msghdr* pMsg,
+                                  uint16_t group, uint64_t userData) {
+    pSqe -> opcode = IORING_OP_RECVMSG;
+    pSqe -> fd = fd;
+    pSqe -> addr = (uint64_t)(uintptr_t)pMsg;
+    pSqe -> len = 1;
+    pSqe -> ioprio = IORING_RECV_MULTISHOT;
+    pSqe -> flags = IOSQE_BUFFER_SELECT;
+    pSqe -> buf_group = group;
+    pSqe -> user_data = userData;
+}
+
+char* Uring_recvmsg_payload(char* buffer, unsigned bufferLen, const struct msghdr* pMsg,
+                            size_t* pLen, char** pControl, size_t* pControlLen) {
+    struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out *)buffer;
+    //buffer layout: header, source address, control data, payload
+    size_t offset = sizeof(*out) + pMsg -> msg_namelen + pMsg -> msg_controllen;
+    if (bufferLen < offset) {
+        return NULL;
+    }
+    size_t room = bufferLen - offset;
+    *pLen = out -> payloadlen < room ? out -> payloadlen : room;
+    if (pControl != NULL) {
+        *pControl = buffer + sizeof(*out) + pMsg -> msg_namelen;
+        *pControlLen = out -> controllen;
+    }
+    return buffer + offset;
+}
+
+struct sockaddr* Uring_recvmsg_name(char* buffer, unsigned bufferLen, socklen_t minLen) {
+    struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out *)buffer;
+    if (bufferLen < sizeof(*out) + minLen || out -> namelen < minLen) {
+        return NULL;
+    }
+    return (struct sockaddr *)(buffer + sizeof(*out));
+}
@@ -0,0 +1,100 @@
+// Minimal io_uring wrapper used by the optional io_uring I/O backend (-u)
+//
+// Talks to the kernel through the raw io_uring_setup/io_uring_enter/io_uring_register
+// syscalls so there is no liburing dependency. A ring is not thread safe; every thread that
+// uses the backend owns its own Uring. All functions returning int give 0 on success and
+// -1 on failure (errno is set), so callers can fall back to plain syscalls.
+
+#ifndef _URING_H_
+#define _URING_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct Uring_s Uring;
+struct Uring_s {
+    int fd;
+
+    // submission queue
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqPending; // sqes handed out but not yet submitted
+
+    // completion queue
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+
+    // mappings to undo in Uring_exit
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+
+    // provided buffer ring (Uring_setup_buffers)
+    struct io_uring_buf_ring *bufRing;
+    size_t bufRingSize;
+    char *bufBase;
+    unsigned bufCount;
+    unsigned bufSize;
+    uint16_t bufGroup;
+
+    // syscalls made through this ring, for stats and the benchmark
+    uint64_t enterCalls;
+};
+
+// Creates a ring with room for entries submissions (rounded up to a power of two by the kernel).
+int Uring_init(Uring* pRing, unsigned entries);
+
+// Unmaps and closes the ring, including any provided buffers.
+void Uring_exit(Uring* pRing);
+
+// Returns a zeroed submission entry, or NULL if the submission queue is full.
+struct io_uring_sqe* Uring_get_sqe(Uring* pRing);
+
+// Submits all pending entries and waits until at least waitNr completions are available.
+// Returns the number of entries submitted, or -1 on failure.
+int Uring_submit(Uring* pRing, unsigned waitNr);
+
+// Returns the next completion without blocking, or NULL if none is ready.
+struct io_uring_cqe* Uring_peek_cqe(Uring* pRing);
+
+// Marks the completion returned by Uring_peek_cqe as consumed.
+void Uring_cqe_seen(Uring* pRing);
+
+// Registers count buffers of size bytes each as provided buffer group group.
+// count must be a power of two.
+int Uring_setup_buffers(Uring* pRing, unsigned count, unsigned size, uint16_t group);
+
+// Address of provided buffer id, and handing it back to the kernel once consumed.
+char* Uring_buffer(Uring* pRing, unsigned id);
+void Uring_recycle_buffer(Uring* pRing, unsigned id);
+
+// Submission helpers. userData comes back in the completion entry.
+void Uring_prep_sendmsg(struct io_uring_sqe* pSqe, int fd, const struct msghdr* pMsg, uint64_t userData);
+void Uring_prep_writev(struct io_uring_sqe* pSqe, int fd, const struct iovec* pIov, unsigned count, uint64_t userData);
+
+// Multishot recvmsg drawing from the provided buffer group. pMsg only describes how much room
+// to leave for the source address and control data; it must stay valid while the request is armed.
+void Uring_prep_recvmsg_multishot(struct io_uring_sqe* pSqe, int fd, struct msghdr* pMsg,
+                                  uint16_t group, uint64_t userData);
+
+// Picks apart a multishot recvmsg buffer (see struct io_uring_recvmsg_out).
+// Returns a pointer to the payload and sets *pLen, or NULL if the buffer is malformed.
+// pControl/pControlLen may be NULL if control data is not needed.
+char* Uring_recvmsg_payload(char* buffer, unsigned bufferLen, const struct msghdr* pMsg,
+                            size_t* pLen, char** pControl, size_t* pControlLen);
+
+// The source address of a multishot recvmsg buffer, NULL if the kernel didn't fill in one that
+// is at least minLen bytes long.
+struct sockaddr* Uring_recvmsg_name(char* buffer, unsigned bufferLen, socklen_t minLen);
+
+#endif